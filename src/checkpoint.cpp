@@ -0,0 +1,188 @@
+// Journal of calculated hashes for resuming interrupted runs
+
+#include "pch.h"
+#include "checkpoint.h"
+
+#include <boost/crc.hpp>
+
+#ifndef WIN32
+#include <unistd.h>
+#endif
+
+namespace fs = boost::filesystem;
+
+namespace
+{
+const char JOURNAL_MAGIC[8] = {'D', 'P', 'X', 'J', 'R', 'N', 'L', '1'};
+// Records are written and synced when the buffer reaches this size, or when the interval has passed
+// since the last sync.
+const size_t SYNC_BUF_SIZE(1024 * 1024);
+const std::chrono::seconds SYNC_INTERVAL(5);
+// Longer paths are taken to be damaged records.
+const u32 MAX_PATH_SIZE(64 * 1024);
+} // namespace
+
+CheckpointJournal::CheckpointJournal() : file(nullptr)
+{
+}
+
+CheckpointJournal::~CheckpointJournal()
+{
+  if (isOpen()) {
+    try {
+      sync();
+    }
+    catch (std::exception &) {
+    }
+    std::fclose(file);
+  }
+}
+
+void CheckpointJournal::open(
+  const fs::path &journalPath, const std::string &algoName, u64 treeSegmentSize, bool isResume)
+{
+  Header header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, JOURNAL_MAGIC, sizeof(JOURNAL_MAGIC));
+  if (algoName.size() >= sizeof(header.algoName)) {
+    throw std::invalid_argument(fmt::format("Hash algorithm name too long: {}", algoName));
+  }
+  memcpy(header.algoName, algoName.data(), algoName.size());
+  header.treeSegmentSize = treeSegmentSize;
+  path = journalPath;
+  if (isResume && fs::exists(path)) {
+    load(header);
+    file = std::fopen(path.c_str(), "ab");
+  }
+  else {
+    file = std::fopen(path.c_str(), "wb");
+    buf.assign(reinterpret_cast<const char *>(&header), sizeof(header));
+  }
+  if (!file) {
+    throw std::runtime_error(fmt::format("Couldn't open checkpoint journal: {}", path.native()));
+  }
+  sync();
+}
+
+bool CheckpointJournal::isOpen() const
+{
+  return file != nullptr;
+}
+
+bool CheckpointJournal::find(const std::string &filePath, u64 size, s64 mtime, Hash &hash) const
+{
+  auto iter = entryMap.find(filePath);
+  if (iter == entryMap.end() || iter->second.size != size || iter->second.mtime != mtime) {
+    return false;
+  }
+  hash = iter->second.hash;
+  return true;
+}
+
+size_t CheckpointJournal::getLoadedCount() const
+{
+  return entryMap.size();
+}
+
+// If the records can't be written, the journal is closed, so hashing can go on without it.
+void CheckpointJournal::append(const std::string &filePath, u64 size, s64 mtime, const Hash &hash)
+{
+  std::lock_guard<std::mutex> lock(mutex);
+  if (!isOpen()) {
+    return;
+  }
+  RecordHeader recordHeader;
+  memset(&recordHeader, 0, sizeof(recordHeader));
+  recordHeader.pathSize = static_cast<u32>(filePath.size());
+  recordHeader.size = size;
+  recordHeader.mtime = mtime;
+  memcpy(recordHeader.hash, hash.data(), hash.size());
+  recordHeader.hashSize = static_cast<u32>(hash.size());
+  recordHeader.checksum = getChecksum(recordHeader, filePath.data());
+  buf.append(reinterpret_cast<const char *>(&recordHeader), sizeof(recordHeader));
+  buf.append(filePath);
+  if (buf.size() >= SYNC_BUF_SIZE ||
+    std::chrono::steady_clock::now() - lastSyncTime >= SYNC_INTERVAL) {
+    sync();
+  }
+}
+
+void CheckpointJournal::close()
+{
+  std::lock_guard<std::mutex> lock(mutex);
+  if (!isOpen()) {
+    return;
+  }
+  sync();
+  auto isError = std::fclose(file) != 0;
+  file = nullptr;
+  if (isError) {
+    throw std::runtime_error(fmt::format("Couldn't write checkpoint journal: {}", path.native()));
+  }
+}
+
+u32 CheckpointJournal::getChecksum(const RecordHeader &recordHeader, const char *filePath)
+{
+  boost::crc_32_type crc;
+  crc.process_bytes(&recordHeader.pathSize, sizeof(recordHeader) - sizeof(recordHeader.checksum));
+  crc.process_bytes(filePath, recordHeader.pathSize);
+  return crc.checksum();
+}
+
+// Read the journal up to the first incomplete or damaged record, then cut off the rest so that new
+// records are appended after the last good one. A later record for the same path replaces the
+// earlier one.
+void CheckpointJournal::load(const Header &expectedHeader)
+{
+  std::ifstream inStream(path.native(), std::ios::binary);
+  Header header;
+  if (!inStream.read(reinterpret_cast<char *>(&header), sizeof(header)) ||
+    memcmp(header.magic, JOURNAL_MAGIC, sizeof(JOURNAL_MAGIC)) != 0) {
+    throw std::runtime_error(fmt::format("Invalid checkpoint journal: {}", path.native()));
+  }
+  if (memcmp(&header, &expectedHeader, sizeof(header)) != 0) {
+    throw std::runtime_error(fmt::format(
+      "Checkpoint journal was written with another hash algorithm or tree segment size: {}",
+      path.native()));
+  }
+  u64 validSize = sizeof(header);
+  RecordHeader recordHeader;
+  std::string filePath;
+  while (inStream.read(reinterpret_cast<char *>(&recordHeader), sizeof(recordHeader))) {
+    if (recordHeader.pathSize > MAX_PATH_SIZE || recordHeader.hashSize > Hash::MAX_SIZE) {
+      break;
+    }
+    filePath.resize(recordHeader.pathSize);
+    if (!inStream.read(&filePath[0], recordHeader.pathSize) ||
+      recordHeader.checksum != getChecksum(recordHeader, filePath.data())) {
+      break;
+    }
+    entryMap[filePath] =
+      Entry{recordHeader.size, recordHeader.mtime, Hash(recordHeader.hash, recordHeader.hashSize)};
+    validSize += sizeof(recordHeader) + recordHeader.pathSize;
+  }
+  inStream.close();
+  if (validSize != fs::file_size(path)) {
+    fs::resize_file(path, validSize);
+  }
+}
+
+// Called with the mutex held.
+void CheckpointJournal::sync()
+{
+  lastSyncTime = std::chrono::steady_clock::now();
+  if (buf.empty()) {
+    return;
+  }
+  auto isError = std::fwrite(buf.data(), 1, buf.size(), file) != buf.size();
+  isError |= std::fflush(file) != 0;
+#ifndef WIN32
+  isError |= fsync(fileno(file)) != 0;
+#endif
+  buf.clear();
+  if (isError) {
+    std::fclose(file);
+    file = nullptr;
+    throw std::runtime_error(fmt::format("Couldn't write checkpoint journal: {}", path.native()));
+  }
+}
@@ -0,0 +1,68 @@
+#pragma once
+
+#include "pch.h"
+#include "hash.h"
+
+#include <cstdio>
+
+// Journal of the hashes calculated in a run, so that a run that is interrupted can be resumed
+// without hashing the same files again. Unlike the hash cache, files are identified by path, so
+// files without inode numbers can be resumed too. A hash is only reused if the size and
+// modification time of the file are still the same.
+//
+// Records are collected in a buffer and written and synced to disk in batches, at most every few
+// seconds, so the journal costs next to nothing while hashing, and an interruption loses at most
+// the last few seconds of work. Each record carries a checksum, so a journal that was cut short is
+// read up to the last complete record. The hash algorithm and tree segment size are stored in the
+// header, and a journal from a run with other settings is rejected.
+class CheckpointJournal {
+public:
+  CheckpointJournal();
+  ~CheckpointJournal();
+  // Start a new journal, or with isResume, load the records in an existing one and append to it.
+  // Throws if the journal can't be opened or was written with other settings.
+  void open(const boost::filesystem::path &path, const std::string &algoName, u64 treeSegmentSize,
+    bool isResume);
+  [[nodiscard]] bool isOpen() const;
+  // Find a loaded hash for a file with the given size and modification time.
+  bool find(const std::string &path, u64 size, s64 mtime, Hash &hash) const;
+  [[nodiscard]] size_t getLoadedCount() const;
+  void append(const std::string &path, u64 size, s64 mtime, const Hash &hash);
+  // Write and sync the remaining records and close the journal.
+  void close();
+
+private:
+  struct Header {
+    char magic[8];
+    char algoName[16];
+    u64 treeSegmentSize;
+  };
+
+  // Followed by the path.
+  struct RecordHeader {
+    u32 checksum;
+    u32 pathSize;
+    u64 size;
+    s64 mtime;
+    u8 hash[Hash::MAX_SIZE];
+    u32 hashSize;
+    u32 reserved;
+  };
+
+  struct Entry {
+    u64 size;
+    s64 mtime;
+    Hash hash;
+  };
+
+  static u32 getChecksum(const RecordHeader &recordHeader, const char *path);
+  void load(const Header &expectedHeader);
+  void sync();
+
+  std::mutex mutex;
+  boost::filesystem::path path;
+  std::unordered_map<std::string, Entry> entryMap;
+  std::string buf;
+  std::FILE *file;
+  std::chrono::steady_clock::time_point lastSyncTime;
+};
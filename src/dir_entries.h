@@ -0,0 +1,28 @@
+#include "pch.h"
+
+// One entry in a directory, with the metadata that the scanner needs.
+class DirEntry {
+public:
+  // FAILED is an entry that couldn't be stat'ed, such as a file that was deleted while the
+  // directory was read.
+  enum Type { REGULAR, DIRECTORY, OTHER, FAILED };
+
+  std::string name;
+  Type type{OTHER};
+  // Only set for failed entries.
+  std::string error;
+  // Only set for regular files.
+  u64 size{0};
+  u64 dev{0};
+  u64 ino{0};
+  u64 nlink{1};
+  // Modification time in nanoseconds since the epoch.
+  s64 mtime{0};
+};
+
+typedef std::vector<DirEntry> DirEntryVec;
+
+// Throws if the directory can't be read. Entries that can't be stat'ed are returned as failed
+// instead, so the rest of the directory is still scanned.
+void readDirEntries(const boost::filesystem::path &dirPath, DirEntryVec &dirEntryVec);
+DirEntry statPath(const boost::filesystem::path &path);
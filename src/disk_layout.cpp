@@ -0,0 +1,110 @@
+// Physical layout of files on their devices
+
+#include "pch.h"
+#include "disk_layout.h"
+
+namespace fs = boost::filesystem;
+
+#ifdef __linux__
+
+#include <fcntl.h>
+#include <linux/fiemap.h>
+#include <linux/fs.h>
+#include <sys/ioctl.h>
+#include <sys/sysmacros.h>
+#include <unistd.h>
+
+namespace
+{
+// Extents with these flags don't have a usable physical offset.
+const u32 UNUSABLE_EXTENT_FLAGS(
+  FIEMAP_EXTENT_UNKNOWN | FIEMAP_EXTENT_DELALLOC | FIEMAP_EXTENT_DATA_INLINE);
+
+fs::path getSysDevPath(u64 dev)
+{
+  return fs::path(fmt::format("/sys/dev/block/{}:{}", major(dev), minor(dev)));
+}
+
+bool readRotational(const fs::path &devPath, bool &isRotational)
+{
+  std::ifstream stream((devPath / "queue" / "rotational").native());
+  int value;
+  if (!(stream >> value)) {
+    return false;
+  }
+  isRotational = value != 0;
+  return true;
+}
+} // namespace
+
+// The FIEMAP request doesn't ask for a sync, so files that are still being written may not have
+// extents yet. FIBMAP needs CAP_SYS_RAWIO, so it only works when running as root.
+u64 getPhysicalOffset(const fs::path &path)
+{
+  int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd == -1) {
+    return UNKNOWN_PHYSICAL_OFFSET;
+  }
+  auto offset = UNKNOWN_PHYSICAL_OFFSET;
+  // Only the first extent is needed, so the request has room for just one.
+  alignas(fiemap) u8 request[sizeof(fiemap) + sizeof(fiemap_extent)] = {};
+  auto map = reinterpret_cast<fiemap *>(request);
+  map->fm_length = FIEMAP_MAX_OFFSET;
+  map->fm_extent_count = 1;
+  if (ioctl(fd, FS_IOC_FIEMAP, map) == 0) {
+    auto &extent = map->fm_extents[0];
+    if (map->fm_mapped_extents && !(extent.fe_flags & UNUSABLE_EXTENT_FLAGS)) {
+      offset = extent.fe_physical;
+    }
+  }
+  else {
+    int blockSize = 0;
+    int block = 0;
+    if (ioctl(fd, FIGETBSZ, &blockSize) == 0 && ioctl(fd, FIBMAP, &block) == 0 && block) {
+      offset = static_cast<u64>(block) * blockSize;
+    }
+  }
+  close(fd);
+  return offset;
+}
+
+// /sys/dev/block has an entry for each device number that links to the device in /sys/block, or to
+// a partition directory below it. Partitions don't have a queue of their own.
+bool isRotationalDevice(u64 dev)
+{
+  auto devPath = getSysDevPath(dev);
+  bool isRotational = false;
+  if (!readRotational(devPath, isRotational)) {
+    readRotational(devPath / "..", isRotational);
+  }
+  return isRotational;
+}
+
+std::string getDeviceName(u64 dev)
+{
+  boost::system::error_code ec;
+  auto target = fs::read_symlink(getSysDevPath(dev), ec);
+  if (ec || target.filename().empty()) {
+    return fmt::format("{}:{}", major(dev), minor(dev));
+  }
+  return target.filename().native();
+}
+
+#else
+
+u64 getPhysicalOffset(const fs::path &)
+{
+  return UNKNOWN_PHYSICAL_OFFSET;
+}
+
+bool isRotationalDevice(u64)
+{
+  return false;
+}
+
+std::string getDeviceName(u64 dev)
+{
+  return fmt::format("{}", dev);
+}
+
+#endif
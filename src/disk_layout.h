@@ -0,0 +1,20 @@
+#pragma once
+
+#include "pch.h"
+
+// Where files are stored on their devices. Used to read files in the order they are laid out on
+// rotational disks, where seeking between files costs far more than reading them.
+
+// Returned by getPhysicalOffset() when the location of a file is not known.
+const u64 UNKNOWN_PHYSICAL_OFFSET = std::numeric_limits<u64>::max();
+
+// Offset in bytes on the device of the first extent of the file, from FIEMAP, or from FIBMAP on
+// file systems without FIEMAP. UNKNOWN_PHYSICAL_OFFSET for empty files, files that have not been
+// written out yet or are stored inline, and file systems that support neither.
+u64 getPhysicalOffset(const boost::filesystem::path &path);
+// True if the block device with this device number is rotational, as reported by the kernel in
+// the queue/rotational attribute of the device in /sys/block. Partitions are looked up through
+// their disk. Devices without an entry, such as network file systems, count as non-rotational.
+bool isRotationalDevice(u64 dev);
+// Name of the block device for messages, such as sda1. Falls back to the device number.
+std::string getDeviceName(u64 dev);
@@ -0,0 +1,395 @@
+// Read files for hashing.
+
+#include "pch.h"
+#include "file_reader.h"
+
+#ifndef WIN32
+#include <csetjmp>
+#include <csignal>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace fs = boost::filesystem;
+
+namespace
+{
+// Reads smaller than this are not worth the cost of setting up and tearing down a mapping.
+const u64 MIN_MAPPED_SIZE(256 * 1024);
+// Alignment of the read buffer. Matches the page size and the block size of common devices, which
+// is also the alignment that O_DIRECT requires for the buffer, offset and length.
+const size_t BUF_ALIGNMENT(4096);
+
+const std::map<std::string, IoPolicy> POLICY_MAP = {
+  {"cached", IoPolicy::CACHED},
+  {"sequential", IoPolicy::SEQUENTIAL},
+  {"direct", IoPolicy::DIRECT},
+};
+
+IoPolicy POLICY(IoPolicy::CACHED);
+u64 READAHEAD_SIZE(0);
+std::atomic<u64> READ_BYTES[3];
+
+struct AlignedFree {
+  void operator()(u8 *p) const
+  {
+#ifdef WIN32
+    _aligned_free(p);
+#else
+    free(p);
+#endif
+  }
+};
+
+// Each worker thread allocates its read buffer once and reuses it for all files.
+u8 *getThreadBuf()
+{
+  thread_local std::unique_ptr<u8, AlignedFree> buf;
+  if (!buf) {
+#ifdef WIN32
+    buf.reset(static_cast<u8 *>(_aligned_malloc(FileReader::CHUNK_SIZE, BUF_ALIGNMENT)));
+#else
+    void *p = nullptr;
+    if (posix_memalign(&p, BUF_ALIGNMENT, FileReader::CHUNK_SIZE) == 0) {
+      buf.reset(static_cast<u8 *>(p));
+    }
+#endif
+    if (!buf) {
+      throw std::bad_alloc();
+    }
+  }
+  return buf.get();
+}
+
+void throwErrno(const fs::path &path, const char *what)
+{
+  throw fs::filesystem_error(
+    what, path, boost::system::error_code(errno, boost::system::system_category()));
+}
+
+#ifndef WIN32
+// Reading a page of a mapping that is past the end of the file raises SIGBUS, which happens if the
+// file is truncated while it's being read. While a thread reads from a mapping, this points to the
+// place that readMapped() jumps back to, so it can fail the read instead of the process being
+// killed.
+thread_local sigjmp_buf *MAPPED_READ_JUMP(nullptr);
+struct sigaction PREV_SIGBUS_ACTION;
+
+void onSigbus(int, siginfo_t *, void *)
+{
+  if (MAPPED_READ_JUMP) {
+    siglongjmp(*MAPPED_READ_JUMP, 1);
+  }
+  // The fault didn't come from a mapped read. Return with the previous handler in place, so the
+  // fault is raised again and handled as it would have been without this one.
+  sigaction(SIGBUS, &PREV_SIGBUS_ACTION, nullptr);
+}
+
+void installSigbusHandler()
+{
+  static std::once_flag onceFlag;
+  std::call_once(onceFlag, []() {
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_sigaction = onSigbus;
+    action.sa_flags = SA_SIGINFO;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGBUS, &action, &PREV_SIGBUS_ACTION);
+  });
+}
+#endif
+} // namespace
+
+const char *getIoPolicyName(IoPolicy policy)
+{
+  for (auto &pair : POLICY_MAP) {
+    if (pair.second == policy) {
+      return pair.first.c_str();
+    }
+  }
+  return "unknown";
+}
+
+IoPolicy parseIoPolicy(const std::string &name)
+{
+  auto iter = POLICY_MAP.find(name);
+  if (iter == POLICY_MAP.end()) {
+    throw std::invalid_argument(fmt::format("Unknown I/O policy: {}", name));
+  }
+  return iter->second;
+}
+
+void FileReader::setPolicy(IoPolicy policy, u64 readaheadSize)
+{
+  POLICY = policy;
+  READAHEAD_SIZE = readaheadSize;
+}
+
+u64 FileReader::getReadBytes(IoPolicy policy)
+{
+  return READ_BYTES[static_cast<size_t>(policy)];
+}
+
+IoPolicy FileReader::getPolicy() const
+{
+  return policy;
+}
+
+void FileReader::countReadBytes(u64 len)
+{
+  READ_BYTES[static_cast<size_t>(policy)] += len;
+}
+
+u64 FileReader::readAll(const ChunkFn &chunkFn)
+{
+  return read(0, std::numeric_limits<u64>::max(), chunkFn);
+}
+
+// The blocks are read one after the other from each file, so mapping them would only add the cost
+// of setting up and tearing down a mapping for each block.
+void FileReader::readBlock(u64 offset, u8 *buf, size_t len)
+{
+  auto readLen = readBuffered(offset, len, [&](const u8 *data, size_t dataLen) {
+    memcpy(buf, data, dataLen);
+    buf += dataLen;
+  });
+  if (readLen != len) {
+    throw fs::filesystem_error("File changed while reading", path,
+      boost::system::errc::make_error_code(boost::system::errc::io_error));
+  }
+}
+
+#ifdef WIN32
+
+// The policies have no equivalent here, so everything is read with CACHED.
+FileReader::FileReader(const fs::path &path)
+  : path(path), policy(IoPolicy::CACHED), readaheadEnd(0)
+{
+  stream.open(path.native(), std::ios::binary);
+  if (!stream.is_open()) {
+    throw fs::filesystem_error("Couldn't open file", path,
+      boost::system::errc::make_error_code(boost::system::errc::io_error));
+  }
+}
+
+FileReader::~FileReader() = default;
+
+u64 FileReader::read(u64 offset, u64 len, const ChunkFn &chunkFn)
+{
+  return readBuffered(offset, len, chunkFn);
+}
+
+bool FileReader::readMapped(u64, u64, const ChunkFn &, u64 &)
+{
+  return false;
+}
+
+u64 FileReader::readDirect(u64 offset, u64 len, const ChunkFn &chunkFn)
+{
+  return readBuffered(offset, len, chunkFn);
+}
+
+void FileReader::adviseReadahead(u64)
+{
+}
+
+void FileReader::dropConsumed(u64, u64)
+{
+}
+
+u64 FileReader::readBuffered(u64 offset, u64 len, const ChunkFn &chunkFn)
+{
+  auto buf = getThreadBuf();
+  stream.clear();
+  stream.seekg(offset);
+  u64 readLen = 0;
+  while (readLen < len && stream) {
+    stream.read(reinterpret_cast<char *>(buf), std::min<u64>(CHUNK_SIZE, len - readLen));
+    auto n = static_cast<size_t>(stream.gcount());
+    if (stream.bad()) {
+      throw fs::filesystem_error("Couldn't read file", path,
+        boost::system::errc::make_error_code(boost::system::errc::io_error));
+    }
+    if (!n) {
+      break;
+    }
+    countReadBytes(n);
+    chunkFn(buf, n);
+    readLen += n;
+  }
+  return readLen;
+}
+
+#else
+
+// File systems that don't support O_DIRECT, such as tmpfs, fail the open with EINVAL. Those files
+// are read with CACHED instead.
+FileReader::FileReader(const fs::path &path) : path(path), policy(POLICY), readaheadEnd(0)
+{
+  fd = -1;
+  if (policy == IoPolicy::DIRECT) {
+    fd = open(path.c_str(), O_RDONLY | O_CLOEXEC | O_DIRECT);
+    if (fd == -1 && errno == EINVAL) {
+      policy = IoPolicy::CACHED;
+    }
+  }
+  if (policy != IoPolicy::DIRECT) {
+    fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  }
+  if (fd == -1) {
+    throwErrno(path, "Couldn't open file");
+  }
+  if (policy == IoPolicy::SEQUENTIAL) {
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+  }
+}
+
+FileReader::~FileReader()
+{
+  close(fd);
+}
+
+int FileReader::getFd() const
+{
+  return fd;
+}
+
+void FileReader::dropConsumed(u64 offset, u64 len)
+{
+  if (policy == IoPolicy::SEQUENTIAL) {
+    posix_fadvise(fd, offset, len, POSIX_FADV_DONTNEED);
+  }
+}
+
+u64 FileReader::read(u64 offset, u64 len, const ChunkFn &chunkFn)
+{
+  u64 readLen;
+  if (policy == IoPolicy::CACHED && len >= MIN_MAPPED_SIZE &&
+    readMapped(offset, len, chunkFn, readLen)) {
+    return readLen;
+  }
+  return readBuffered(offset, len, chunkFn);
+}
+
+// Map the requested range and hand it out directly from the mapping. The size is taken from the
+// open file, so the mapping never extends past the end. Returns false if the file can't be mapped,
+// in which case nothing has been passed to the callback. If the file is truncated while the
+// mapping is read, the read throws, as a read() would have come up short.
+bool FileReader::readMapped(u64 offset, u64 len, const ChunkFn &chunkFn, u64 &readLen)
+{
+  installSigbusHandler();
+  struct stat st;
+  if (fstat(fd, &st) == -1 || static_cast<u64>(st.st_size) <= offset) {
+    return false;
+  }
+  readLen = std::min<u64>(len, st.st_size - offset);
+  // Mappings must start on a page boundary.
+  static const u64 pageSize = sysconf(_SC_PAGESIZE);
+  auto mapOffset = offset / pageSize * pageSize;
+  auto mapLen = readLen + (offset - mapOffset);
+  auto p = mmap(nullptr, mapLen, PROT_READ, MAP_PRIVATE, fd, mapOffset);
+  if (p == MAP_FAILED) {
+    return false;
+  }
+  madvise(p, mapLen, MADV_SEQUENTIAL);
+  auto data = static_cast<const u8 *>(p) + (offset - mapOffset);
+  sigjmp_buf jump;
+  if (sigsetjmp(jump, 1)) {
+    MAPPED_READ_JUMP = nullptr;
+    munmap(p, mapLen);
+    throw fs::filesystem_error("File changed while reading", path,
+      boost::system::errc::make_error_code(boost::system::errc::io_error));
+  }
+  MAPPED_READ_JUMP = &jump;
+  try {
+    for (u64 pos = 0; pos < readLen; pos += CHUNK_SIZE) {
+      auto chunkLen = std::min<u64>(CHUNK_SIZE, readLen - pos);
+      adviseReadahead(offset + pos);
+      countReadBytes(chunkLen);
+      chunkFn(data + pos, chunkLen);
+    }
+  }
+  catch (...) {
+    MAPPED_READ_JUMP = nullptr;
+    munmap(p, mapLen);
+    throw;
+  }
+  MAPPED_READ_JUMP = nullptr;
+  munmap(p, mapLen);
+  return true;
+}
+
+u64 FileReader::readBuffered(u64 offset, u64 len, const ChunkFn &chunkFn)
+{
+  if (policy == IoPolicy::DIRECT) {
+    return readDirect(offset, len, chunkFn);
+  }
+  auto buf = getThreadBuf();
+  u64 readLen = 0;
+  while (readLen < len) {
+    auto pos = offset + readLen;
+    adviseReadahead(pos);
+    auto n = pread(fd, buf, std::min<u64>(CHUNK_SIZE, len - readLen), pos);
+    if (n == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      throwErrno(path, "Couldn't read file");
+    }
+    if (!n) {
+      break;
+    }
+    countReadBytes(n);
+    chunkFn(buf, n);
+    dropConsumed(pos, n);
+    readLen += n;
+  }
+  return readLen;
+}
+
+// O_DIRECT transfers must be aligned, so whole aligned chunks are read into the thread buffer and
+// only the requested part is passed on. The last read of a file may return less than a whole
+// chunk, which O_DIRECT allows at the end of the file.
+u64 FileReader::readDirect(u64 offset, u64 len, const ChunkFn &chunkFn)
+{
+  auto buf = getThreadBuf();
+  u64 readLen = 0;
+  while (readLen < len) {
+    auto pos = offset + readLen;
+    auto alignedPos = pos / BUF_ALIGNMENT * BUF_ALIGNMENT;
+    auto skip = pos - alignedPos;
+    auto wantLen = std::min<u64>(CHUNK_SIZE - skip, len - readLen) + skip;
+    wantLen = (wantLen + BUF_ALIGNMENT - 1) / BUF_ALIGNMENT * BUF_ALIGNMENT;
+    auto n = pread(fd, buf, wantLen, alignedPos);
+    if (n == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      throwErrno(path, "Couldn't read file");
+    }
+    if (static_cast<u64>(n) <= skip) {
+      break;
+    }
+    auto chunkLen = std::min<u64>(n - skip, len - readLen);
+    countReadBytes(n);
+    chunkFn(buf + skip, chunkLen);
+    readLen += chunkLen;
+  }
+  return readLen;
+}
+
+// Ask for the next window once the position gets within half a window of the end of the previous
+// one, so the kernel always has at least half a window in flight.
+void FileReader::adviseReadahead(u64 pos)
+{
+  if (!READAHEAD_SIZE || pos + READAHEAD_SIZE / 2 < readaheadEnd) {
+    return;
+  }
+  auto begin = std::max(pos, readaheadEnd);
+  readaheadEnd = pos + READAHEAD_SIZE;
+  posix_fadvise(fd, begin, readaheadEnd - begin, POSIX_FADV_WILLNEED);
+}
+
+#endif
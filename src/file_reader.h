@@ -0,0 +1,76 @@
+#pragma once
+
+#include "pch.h"
+
+// Callback that receives consecutive chunks of file contents.
+typedef std::function<void(const u8 *data, size_t len)> ChunkFn;
+
+// How file contents are read, in particular how the page cache is used. CACHED leaves the page
+// cache to the kernel. SEQUENTIAL tells the kernel that files are read sequentially and drops the
+// pages of each chunk from the cache once it has been consumed, so that a large run doesn't evict
+// the data of other programs. DIRECT bypasses the page cache with O_DIRECT where the file system
+// supports it and falls back to CACHED elsewhere.
+enum class IoPolicy { CACHED, SEQUENTIAL, DIRECT };
+
+const char *getIoPolicyName(IoPolicy policy);
+// Throws std::invalid_argument for unknown names.
+IoPolicy parseIoPolicy(const std::string &name);
+
+// Read files for hashing with as little copying as the platform allows. Large reads go through a
+// memory mapping of the requested range, so the hash functions work directly on the page cache.
+// Small reads, and large reads where the file can't be mapped, go through a per-thread aligned
+// buffer with plain read calls. The SEQUENTIAL and DIRECT policies always read through the buffer.
+// The data is passed to the callback in chunks of at most CHUNK_SIZE bytes.
+class FileReader {
+public:
+  static const size_t CHUNK_SIZE = 1024 * 1024;
+
+  explicit FileReader(const boost::filesystem::path &path);
+  ~FileReader();
+  FileReader(const FileReader &) = delete;
+  FileReader &operator=(const FileReader &) = delete;
+
+  // Read len bytes starting at offset. Returns the number of bytes read, which is less than len if
+  // the end of the file was reached.
+  u64 read(u64 offset, u64 len, const ChunkFn &chunkFn);
+  // Read the file from start to end. Returns the number of bytes read.
+  u64 readAll(const ChunkFn &chunkFn);
+  // Read exactly len bytes starting at offset into buf. Used where the caller needs the data of
+  // several files side by side. Throws if the file ends before len bytes have been read.
+  void readBlock(u64 offset, u8 *buf, size_t len);
+
+  // Set the policy for all readers opened after the call. If readaheadSize is not 0, the kernel is
+  // asked to read that many bytes ahead of the current position, instead of using its own
+  // readahead window. Has no effect on the DIRECT policy, which reads exactly what is requested.
+  static void setPolicy(IoPolicy policy, u64 readaheadSize);
+  // Number of bytes read with a policy by all readers so far. Files that fell back from DIRECT are
+  // counted as CACHED.
+  static u64 getReadBytes(IoPolicy policy);
+
+  // For readers that issue their own reads on the open file, such as UringReader. The policy is
+  // the one the file was opened with, after any fallback. Reads must be counted with
+  // countReadBytes(), and consumed ranges passed to dropConsumed() once they have been hashed.
+  IoPolicy getPolicy() const;
+  void countReadBytes(u64 len);
+  void dropConsumed(u64 offset, u64 len);
+#ifndef WIN32
+  int getFd() const;
+#endif
+
+private:
+  bool readMapped(u64 offset, u64 len, const ChunkFn &chunkFn, u64 &readLen);
+  u64 readBuffered(u64 offset, u64 len, const ChunkFn &chunkFn);
+  u64 readDirect(u64 offset, u64 len, const ChunkFn &chunkFn);
+  void adviseReadahead(u64 pos);
+
+  boost::filesystem::path path;
+  // Policy of this reader, after any fallback.
+  IoPolicy policy;
+  // End of the range that the kernel has already been asked to read ahead.
+  u64 readaheadEnd;
+#ifdef WIN32
+  std::ifstream stream;
+#else
+  int fd;
+#endif
+};
@@ -2,6 +2,7 @@
 
 #include "pch.h"
 #include "fnv_1a_64.h"
+#include "file_reader.h"
 
 
 using namespace std;
@@ -11,38 +12,30 @@ namespace fs = boost::filesystem;
 // 64 bit magic FNV-1a prime
 const u64 FNV_64_PRIME(0x100000001b3ULL);
 const u64 FNV1A_64_INIT(0xcbf29ce484222325ULL);
-const streamsize BUF_SIZE(1024 * 1024);
-u64 _fnv1A64Buf(void* buf, size_t len, u64 hash);
 
-Hash fnv1A64(const filesystem::wpath &path)
+// Hash len bytes starting at offset. Used for ruling out candidates before hashing full contents,
+// so the hash is returned as a number. Throws if the file ends before len bytes have been read, as
+// the hash of a shorter block could match the hash of the same block in another file.
+u64 fnv1A64Block(const fs::path &path, u64 offset, size_t len)
 {
   u64 hash(FNV1A_64_INIT);
-
-  boost::filesystem::ifstream ifs;
-  ifs.exceptions(ifstream::badbit);
-  ifs.open(path, ifstream::binary);
-
-  if (!ifs.is_open()) {
-    throw std::exception();
+  FileReader reader(path);
+  auto readLen = reader.read(
+    offset, len, [&](const u8* data, size_t dataLen) { hash = _fnv1A64Buf(data, dataLen, hash); });
+  if (readLen != len) {
+    throw fs::filesystem_error("File changed while reading", path,
+      boost::system::errc::make_error_code(boost::system::errc::io_error));
   }
-
-  scoped_array<u8> buf(new u8[BUF_SIZE]);
-
-  do {
-    ifs.read(reinterpret_cast<char*>(buf.get()), BUF_SIZE);
-    hash = _fnv1A64Buf(buf.get(), ifs.gcount(), hash);
-  } while (ifs);
-
-  return fmt::format("{:0>16x}", hash);
+  return hash;
 }
 
 
-u64 _fnv1A64Buf(void* buf, size_t len, u64 hash)
+u64 _fnv1A64Buf(const void* buf, size_t len, u64 hash)
 {
   // start of buffer
-  u8* bp = (u8*)buf;
+  const u8* bp = (const u8*)buf;
   // beyond end of buffer
-  u8* be = bp + len;
+  const u8* be = bp + len;
 
   while (bp < be) {
     // xor the bottom with the current octet
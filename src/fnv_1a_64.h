@@ -1,5 +1,6 @@
 #include "pch.h"
 
-typedef std::string Hash;
+extern const u64 FNV1A_64_INIT;
 
-Hash fnv1A64(const boost::filesystem::wpath& path);
+u64 fnv1A64Block(const boost::filesystem::wpath& path, u64 offset, size_t len);
+u64 _fnv1A64Buf(const void* buf, size_t len, u64 hash);
@@ -0,0 +1,126 @@
+#pragma once
+
+#include "pch.h"
+
+// Fixed width binary digest. Holds hashes of up to 256 bits without any heap allocation, so a
+// FileInfo carries its hash inline and hashes are compared with a memcmp. Hashes are only converted
+// to hex digits for display. An empty hash means that the file has not been hashed.
+class Hash {
+public:
+  static constexpr size_t MAX_SIZE = 32;
+
+  Hash() : bytes{}, len(0)
+  {
+  }
+
+  Hash(const u8 *data, size_t size) : bytes{}, len(static_cast<u8>(std::min(size, MAX_SIZE)))
+  {
+    memcpy(bytes.data(), data, len);
+  }
+
+  // Store a 64 bit hash big endian, so that the hex digits are the same as for the number.
+  static Hash fromU64(u64 v)
+  {
+    u8 data[8];
+    for (size_t i = 0; i < 8; ++i) {
+      data[i] = static_cast<u8>(v >> (56 - i * 8));
+    }
+    return Hash(data, sizeof(data));
+  }
+
+  // Throws if the string is not an even number of hex digits.
+  static Hash fromHex(const std::string &hex)
+  {
+    if (hex.size() % 2 || hex.size() > MAX_SIZE * 2) {
+      throw std::runtime_error(fmt::format("Invalid hash: {}", hex));
+    }
+    Hash hash;
+    hash.len = static_cast<u8>(hex.size() / 2);
+    for (size_t i = 0; i < hash.len; ++i) {
+      auto hi = hexValue(hex[i * 2]);
+      auto lo = hexValue(hex[i * 2 + 1]);
+      if (hi < 0 || lo < 0) {
+        throw std::runtime_error(fmt::format("Invalid hash: {}", hex));
+      }
+      hash.bytes[i] = static_cast<u8>(hi << 4 | lo);
+    }
+    return hash;
+  }
+
+  [[nodiscard]] u64 toU64() const
+  {
+    u64 v = 0;
+    for (size_t i = 0; i < std::min<size_t>(len, 8); ++i) {
+      v = v << 8 | bytes[i];
+    }
+    return v;
+  }
+
+  [[nodiscard]] std::string hex() const
+  {
+    static const char digits[] = "0123456789abcdef";
+    std::string s(len * 2, '0');
+    for (size_t i = 0; i < len; ++i) {
+      s[i * 2] = digits[bytes[i] >> 4];
+      s[i * 2 + 1] = digits[bytes[i] & 0xf];
+    }
+    return s;
+  }
+
+  [[nodiscard]] bool empty() const
+  {
+    return !len;
+  }
+
+  [[nodiscard]] const u8 *data() const
+  {
+    return bytes.data();
+  }
+
+  [[nodiscard]] size_t size() const
+  {
+    return len;
+  }
+
+  // Unused bytes are always zero, so they can be included in the comparison.
+  bool operator<(const Hash &other) const
+  {
+    auto r = memcmp(bytes.data(), other.bytes.data(), MAX_SIZE);
+    return r ? r < 0 : len < other.len;
+  }
+
+  bool operator==(const Hash &other) const
+  {
+    return len == other.len && !memcmp(bytes.data(), other.bytes.data(), MAX_SIZE);
+  }
+
+  bool operator!=(const Hash &other) const
+  {
+    return !(*this == other);
+  }
+
+private:
+  static int hexValue(char c)
+  {
+    if (c >= '0' && c <= '9') {
+      return c - '0';
+    }
+    if (c >= 'a' && c <= 'f') {
+      return c - 'a' + 10;
+    }
+    if (c >= 'A' && c <= 'F') {
+      return c - 'A' + 10;
+    }
+    return -1;
+  }
+
+  std::array<u8, MAX_SIZE> bytes;
+  u8 len;
+};
+
+template <> struct fmt::formatter<Hash> : fmt::formatter<std::string> {
+  template <typename FormatContext> auto format(const Hash &hash, FormatContext &ctx)
+  {
+    return fmt::formatter<std::string>::format(hash.hex(), ctx);
+  }
+};
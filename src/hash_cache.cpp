@@ -0,0 +1,282 @@
+// Persistent cache of file hashes
+
+#include "pch.h"
+#include "hash_cache.h"
+
+#include <boost/crc.hpp>
+#include <cstdio>
+
+#ifndef WIN32
+#include <unistd.h>
+#endif
+
+namespace fs = boost::filesystem;
+namespace bip = boost::interprocess;
+
+namespace
+{
+const char TABLE_MAGIC[8] = {'D', 'P', 'X', 'C', 'A', 'C', 'H', '2'};
+// Size of the log buffer that triggers a write.
+const size_t LOG_BUF_SIZE(64 * 1024);
+
+struct TableHeader {
+  char magic[8];
+  u64 recordCount;
+};
+} // namespace
+
+HashCache::HashCache() : tableBegin(nullptr), tableEnd(nullptr), hitCount(0), missCount(0)
+{
+}
+
+HashCache::~HashCache()
+{
+  if (isOpen()) {
+    flushLog();
+  }
+}
+
+void HashCache::open(const fs::path &path)
+{
+  tablePath = path;
+  logPath = path.native() + ".log";
+  loadTable();
+  loadLog();
+  logStream.open(logPath.native(), std::ios::binary | std::ios::app);
+  if (!logStream.is_open()) {
+    throw std::runtime_error(fmt::format("Couldn't open hash cache log: {}", logPath.native()));
+  }
+}
+
+bool HashCache::isOpen() const
+{
+  return logStream.is_open();
+}
+
+// Files without an inode number, such as files listed in md5 lists, are not cached.
+bool HashCache::find(const Key &key, Hash &hash)
+{
+  if (!isOpen() || !key.ino) {
+    return false;
+  }
+  std::lock_guard<std::mutex> lock(mutex);
+  auto logIter = logMap.find(key);
+  if (logIter != logMap.end()) {
+    logIter->second.isTouched = true;
+    hash = getHash(logIter->second.record);
+    ++hitCount;
+    return true;
+  }
+  auto record = findInTable(key);
+  if (record) {
+    isTableTouchedVec[record - tableBegin] = true;
+    hash = getHash(*record);
+    ++hitCount;
+    return true;
+  }
+  ++missCount;
+  return false;
+}
+
+bool HashCache::contains(const Key &key)
+{
+  if (!isOpen() || !key.ino) {
+    return false;
+  }
+  std::lock_guard<std::mutex> lock(mutex);
+  return logMap.count(key) || findInTable(key);
+}
+
+void HashCache::insert(const Key &key, const Hash &hash)
+{
+  if (!isOpen() || !key.ino) {
+    return;
+  }
+  auto record = makeRecord(key, hash);
+  std::lock_guard<std::mutex> lock(mutex);
+  logMap[key] = LogEntry{record, true};
+  logBuf.append(reinterpret_cast<const char *>(&record), sizeof(record));
+  if (logBuf.size() >= LOG_BUF_SIZE) {
+    flushLog();
+  }
+}
+
+void HashCache::close(bool isCompact)
+{
+  if (!isOpen()) {
+    return;
+  }
+  flushLog();
+  logStream.close();
+  if (!logMap.empty() || isCompact) {
+    writeTable(isCompact);
+  }
+  fs::remove(logPath);
+  tableRegion = bip::mapped_region();
+  tableMapping = bip::file_mapping();
+  tableBegin = tableEnd = nullptr;
+  isTableTouchedVec.clear();
+  logMap.clear();
+}
+
+size_t HashCache::getHitCount() const
+{
+  return hitCount;
+}
+
+size_t HashCache::getMissCount() const
+{
+  return missCount;
+}
+
+HashCache::Key HashCache::getKey(const Record &record)
+{
+  return Key(record.dev, record.ino, record.size, record.mtime, static_cast<Algo>(record.algo),
+    record.param);
+}
+
+HashCache::Record HashCache::makeRecord(const Key &key, const Hash &hash)
+{
+  Record record;
+  memset(&record, 0, sizeof(record));
+  record.dev = key.dev;
+  record.ino = key.ino;
+  record.size = key.size;
+  record.mtime = key.mtime;
+  record.algo = key.algo;
+  record.param = key.param;
+  memcpy(record.hash, hash.data(), hash.size());
+  record.hashSize = static_cast<u32>(hash.size());
+  record.checksum = getChecksum(record);
+  return record;
+}
+
+u32 HashCache::getChecksum(const Record &record)
+{
+  boost::crc_32_type crc;
+  crc.process_bytes(&record, offsetof(Record, checksum));
+  return crc.checksum();
+}
+
+Hash HashCache::getHash(const Record &record)
+{
+  return Hash(record.hash, record.hashSize);
+}
+
+// Map the table. A missing table is the same as an empty one.
+void HashCache::loadTable()
+{
+  if (!fs::exists(tablePath) || !fs::file_size(tablePath)) {
+    return;
+  }
+  tableMapping = bip::file_mapping(tablePath.c_str(), bip::read_only);
+  tableRegion = bip::mapped_region(tableMapping, bip::read_only);
+  auto header = static_cast<const TableHeader *>(tableRegion.get_address());
+  if (tableRegion.get_size() < sizeof(TableHeader) ||
+    memcmp(header->magic, TABLE_MAGIC, sizeof(TABLE_MAGIC)) != 0 ||
+    tableRegion.get_size() != sizeof(TableHeader) + header->recordCount * sizeof(Record)) {
+    throw std::runtime_error(fmt::format("Invalid hash cache: {}", tablePath.native()));
+  }
+  tableBegin = reinterpret_cast<const Record *>(header + 1);
+  tableEnd = tableBegin + header->recordCount;
+  isTableTouchedVec.resize(header->recordCount, false);
+}
+
+// Read the log up to the first incomplete or damaged record, then cut off the rest so that new
+// records are appended after the last good one.
+void HashCache::loadLog()
+{
+  if (!fs::exists(logPath)) {
+    return;
+  }
+  std::ifstream logInStream(logPath.native(), std::ios::binary);
+  Record record;
+  u64 validSize = 0;
+  while (logInStream.read(reinterpret_cast<char *>(&record), sizeof(record))) {
+    if (record.checksum != getChecksum(record) || record.hashSize > sizeof(record.hash)) {
+      break;
+    }
+    logMap[getKey(record)] = LogEntry{record, false};
+    validSize += sizeof(record);
+  }
+  logInStream.close();
+  if (validSize != fs::file_size(logPath)) {
+    fs::resize_file(logPath, validSize);
+  }
+}
+
+void HashCache::flushLog()
+{
+  if (logBuf.empty()) {
+    return;
+  }
+  logStream.write(logBuf.data(), logBuf.size());
+  logStream.flush();
+  logBuf.clear();
+}
+
+// Merge the sorted table with the sorted log into a new table. Log records replace table records
+// with the same key. The new table is written to a temporary file that is synced to disk before it
+// replaces the old table, so a crash leaves either the old or the new table.
+void HashCache::writeTable(bool isCompact)
+{
+  auto tmpPath = fs::path(tablePath.native() + ".tmp");
+  auto file = std::fopen(tmpPath.c_str(), "wb");
+  if (!file) {
+    throw std::runtime_error(fmt::format("Couldn't write hash cache: {}", tmpPath.native()));
+  }
+  TableHeader header;
+  memcpy(header.magic, TABLE_MAGIC, sizeof(TABLE_MAGIC));
+  header.recordCount = 0;
+  std::fwrite(&header, sizeof(header), 1, file);
+
+  auto write = [&](const Record &record) {
+    std::fwrite(&record, sizeof(record), 1, file);
+    ++header.recordCount;
+  };
+  auto tableRecord = tableBegin;
+  auto logIter = logMap.begin();
+  while (tableRecord != tableEnd || logIter != logMap.end()) {
+    auto isTableNext = tableRecord != tableEnd &&
+      (logIter == logMap.end() || getKey(*tableRecord) < logIter->first);
+    if (isTableNext) {
+      if (!isCompact || isTableTouchedVec[tableRecord - tableBegin]) {
+        write(*tableRecord);
+      }
+      ++tableRecord;
+      continue;
+    }
+    if (tableRecord != tableEnd && getKey(*tableRecord) == logIter->first) {
+      ++tableRecord;
+    }
+    if (!isCompact || logIter->second.isTouched) {
+      write(logIter->second.record);
+    }
+    ++logIter;
+  }
+
+  std::fseek(file, 0, SEEK_SET);
+  std::fwrite(&header, sizeof(header), 1, file);
+  auto isError = std::fflush(file) != 0;
+#ifndef WIN32
+  isError |= fsync(fileno(file)) != 0;
+#endif
+  isError |= std::fclose(file) != 0;
+  if (isError) {
+    fs::remove(tmpPath);
+    throw std::runtime_error(fmt::format("Couldn't write hash cache: {}", tmpPath.native()));
+  }
+  tableRegion = bip::mapped_region();
+  tableMapping = bip::file_mapping();
+  fs::rename(tmpPath, tablePath);
+}
+
+const HashCache::Record *HashCache::findInTable(const Key &key)
+{
+  auto iter = std::lower_bound(tableBegin, tableEnd, key,
+    [](const Record &record, const Key &key) { return getKey(record) < key; });
+  if (iter != tableEnd && getKey(*iter) == key) {
+    return iter;
+  }
+  return nullptr;
+}
@@ -0,0 +1,107 @@
+#pragma once
+
+#include "pch.h"
+#include "hash.h"
+
+#include <boost/interprocess/file_mapping.hpp>
+#include <boost/interprocess/mapped_region.hpp>
+
+// Persistent cache of file hashes, so that files that have not changed since an earlier run don't
+// have to be read again. A file is identified by its device and inode and is considered unchanged
+// if its size and modification time are the same.
+//
+// The cache is stored in two files. The table holds fixed size records sorted by key and is memory
+// mapped when the cache is opened, so loading it costs nothing up front and lookups are binary
+// searches. New hashes are appended to a log next to the table. Each record carries a checksum, so
+// a log that was cut short by a crash is read up to the last complete record. When the cache is
+// closed, the log is merged into a new table, which replaces the old one in a single rename.
+class HashCache {
+public:
+  // Values are stored in the files, so they must not change.
+  enum Algo : u32 { FNV64 = 1, MD5 = 2, HEAD_FNV64 = 3, TAIL_FNV64 = 4, WIDE128 = 5 };
+
+  class Key {
+  public:
+    Key(u64 dev, u64 ino, u64 size, s64 mtime, Algo algo, u32 param)
+      : dev(dev), ino(ino), size(size), mtime(mtime), algo(algo), param(param)
+    {
+    }
+
+    bool operator<(const Key &other) const
+    {
+      return std::tie(dev, ino, size, mtime, algo, param) <
+        std::tie(other.dev, other.ino, other.size, other.mtime, other.algo, other.param);
+    }
+
+    bool operator==(const Key &other) const
+    {
+      return std::tie(dev, ino, size, mtime, algo, param) ==
+        std::tie(other.dev, other.ino, other.size, other.mtime, other.algo, other.param);
+    }
+
+    u64 dev;
+    u64 ino;
+    u64 size;
+    s64 mtime;
+    u32 algo;
+    // Algorithm parameter, such as the size of the block for the block hashes.
+    u32 param;
+  };
+
+  HashCache();
+  ~HashCache();
+  void open(const boost::filesystem::path &path);
+  [[nodiscard]] bool isOpen() const;
+  bool find(const Key &key, Hash &hash);
+  // Check for a hash without counting it as a hit or miss.
+  [[nodiscard]] bool contains(const Key &key);
+  void insert(const Key &key, const Hash &hash);
+  // Merge the log into the table and close the cache. If isCompact is set, entries that were not
+  // looked up or inserted since the cache was opened are dropped.
+  void close(bool isCompact);
+  [[nodiscard]] size_t getHitCount() const;
+  [[nodiscard]] size_t getMissCount() const;
+
+private:
+  // On-disk record. Hashes are stored in binary, with their size in bytes.
+  struct Record {
+    u64 dev;
+    u64 ino;
+    u64 size;
+    s64 mtime;
+    u32 algo;
+    u32 param;
+    u8 hash[Hash::MAX_SIZE];
+    u32 hashSize;
+    u32 checksum;
+  };
+
+  struct LogEntry {
+    Record record;
+    bool isTouched;
+  };
+
+  static Key getKey(const Record &record);
+  static Record makeRecord(const Key &key, const Hash &hash);
+  static u32 getChecksum(const Record &record);
+  static Hash getHash(const Record &record);
+  void loadTable();
+  void loadLog();
+  void flushLog();
+  void writeTable(bool isCompact);
+  const Record *findInTable(const Key &key);
+
+  std::mutex mutex;
+  boost::filesystem::path tablePath;
+  boost::filesystem::path logPath;
+  boost::interprocess::file_mapping tableMapping;
+  boost::interprocess::mapped_region tableRegion;
+  const Record *tableBegin;
+  const Record *tableEnd;
+  std::vector<char> isTableTouchedVec;
+  std::map<Key, LogEntry> logMap;
+  std::string logBuf;
+  std::ofstream logStream;
+  size_t hitCount;
+  size_t missCount;
+};
@@ -0,0 +1,131 @@
+// Hash algorithms for full file contents.
+
+#include "pch.h"
+#include "hasher.h"
+#include "file_reader.h"
+#include "fnv_1a_64.h"
+#include "md5.hpp"
+#include "wide_hash.h"
+
+namespace fs = boost::filesystem;
+
+namespace
+{
+class Wide128Hasher : public Hasher {
+public:
+  void update(const u8 *data, size_t len) override
+  {
+    hash.update(data, len);
+  }
+
+  Hash digest() override
+  {
+    u8 digest[16];
+    hash.digest(digest);
+    return Hash(digest, sizeof(digest));
+  }
+
+private:
+  Wide128 hash;
+};
+
+class Fnv64Hasher : public Hasher {
+public:
+  void update(const u8 *data, size_t len) override
+  {
+    hash = _fnv1A64Buf(data, len, hash);
+  }
+
+  Hash digest() override
+  {
+    return Hash::fromU64(hash);
+  }
+
+private:
+  u64 hash{FNV1A_64_INIT};
+};
+
+class Md5Hasher : public Hasher {
+public:
+  // md5 counts bits in 32 bit words, so it's fed at most 1 MiB at a time.
+  void update(const u8 *data, size_t len) override
+  {
+    const size_t maxLen = 1024 * 1024;
+    for (size_t pos = 0; pos < len; pos += maxLen) {
+      hash.update(data + pos, static_cast<u32>(std::min(maxLen, len - pos)));
+    }
+  }
+
+  Hash digest() override
+  {
+    const auto &digest = hash.digest().value();
+    return Hash(digest, sizeof(digest));
+  }
+
+private:
+  boost::md5 hash;
+};
+
+const std::map<HashAlgo, const char *> ALGO_NAME_MAP = {
+  {HashAlgo::WIDE128, "wide128"},
+  {HashAlgo::FNV64, "fnv64"},
+  {HashAlgo::MD5, "md5"},
+};
+} // namespace
+
+std::unique_ptr<Hasher> createHasher(HashAlgo algo)
+{
+  switch (algo) {
+  case HashAlgo::FNV64:
+    return std::make_unique<Fnv64Hasher>();
+  case HashAlgo::MD5:
+    return std::make_unique<Md5Hasher>();
+  default:
+    return std::make_unique<Wide128Hasher>();
+  }
+}
+
+Hash hashFile(const fs::path &path, HashAlgo algo)
+{
+  auto hasher = createHasher(algo);
+  FileReader reader(path);
+  reader.readAll([&](const u8 *data, size_t len) { hasher->update(data, len); });
+  return hasher->digest();
+}
+
+Hash hashFileRange(const fs::path &path, HashAlgo algo, u64 offset, u64 len)
+{
+  auto hasher = createHasher(algo);
+  FileReader reader(path);
+  auto readLen =
+    reader.read(offset, len, [&](const u8 *data, size_t dataLen) { hasher->update(data, dataLen); });
+  if (readLen != len) {
+    throw fs::filesystem_error("File changed while reading", path,
+      boost::system::errc::make_error_code(boost::system::errc::io_error));
+  }
+  return hasher->digest();
+}
+
+Hash hashTreeRoot(const std::vector<Hash> &segmentHashVec, HashAlgo algo)
+{
+  auto hasher = createHasher(algo);
+  for (const auto &segmentHash : segmentHashVec) {
+    hasher->update(segmentHash.data(), segmentHash.size());
+  }
+  return hasher->digest();
+}
+
+const char *getHashAlgoName(HashAlgo algo)
+{
+  return ALGO_NAME_MAP.at(algo);
+}
+
+HashAlgo parseHashAlgo(const std::string &name)
+{
+  for (const auto &algoName : ALGO_NAME_MAP) {
+    if (boost::iequals(name, algoName.second)) {
+      return algoName.first;
+    }
+  }
+  throw std::runtime_error(fmt::format("Unknown hash algorithm: {}", name));
+}
@@ -0,0 +1,27 @@
+#pragma once
+
+#include "pch.h"
+#include "hash.h"
+
+// Algorithms for hashing the full contents of files.
+enum class HashAlgo { WIDE128, FNV64, MD5 };
+
+// Streaming hash of file contents. Each algorithm wraps its own state behind this interface, so
+// calculateHash() doesn't need to know which one is in use.
+class Hasher {
+public:
+  virtual ~Hasher() = default;
+  virtual void update(const u8 *data, size_t len) = 0;
+  // Finish the hash. Can only be called once.
+  virtual Hash digest() = 0;
+};
+
+std::unique_ptr<Hasher> createHasher(HashAlgo algo);
+Hash hashFile(const boost::filesystem::path &path, HashAlgo algo);
+// Hash len bytes starting at offset. Throws if the file ends before that.
+Hash hashFileRange(const boost::filesystem::path &path, HashAlgo algo, u64 offset, u64 len);
+// Combine the hashes of the segments of a file into the root hash of a tree.
+Hash hashTreeRoot(const std::vector<Hash> &segmentHashVec, HashAlgo algo);
+// Names are used on the command line and in messages.
+const char *getHashAlgoName(HashAlgo algo);
+HashAlgo parseHashAlgo(const std::string &name);
@@ -7,10 +7,22 @@
 
 #include "pch.h"
 
+#include "checkpoint.h"
+#include "dir_entries.h"
+#include "disk_layout.h"
+#include "file_reader.h"
 #include "fnv_1a_64.h"
+#include "hash_cache.h"
+#include "hasher.h"
 #include "junction.h"
+#include "manifest.h"
+#include "md5_list.h"
+#include "md5_multi_buffer.h"
+#include "rule_matcher.h"
+#include "uring_reader.h"
+#include "work_queue.h"
 
-#include "md5.hpp"
+#include "wide_hash.h"
 
 #ifndef WIN32
 using namespace __gnu_cxx;
@@ -26,141 +38,329 @@ namespace po = boost::program_options;
 std::vector<fs::path> PATH_VEC_ARG;
 std::vector<fs::path> RECURSIVE_PATH_VEC_ARG;
 std::vector<fs::path> MD5_PATH_VEC_ARG;
+std::vector<fs::path> MANIFEST_PATH_VEC_ARG;
+fs::path HASH_CACHE_PATH_ARG;
+fs::path CHECKPOINT_PATH_ARG;
 std::vector<std::string> RULE_VEC_ARG;
 bool AUTOMATIC_ARG(false);
 bool VERBOSE_ARG(false);
 bool QUIET_ARG(false);
 bool DEBUG_ARG(false);
 bool USE_MD5_ARG(false);
+std::string HASH_ALGO_ARG("wide128");
 bool DRY_RUN_ARG(false);
+bool COMPACT_CACHE_ARG(false);
+bool RESUME_ARG(false);
 size_t IGNORE_SMALLER_ARG((size_t)-1), IGNORE_LARGER_ARG((size_t)-1);
+size_t THREAD_COUNT_ARG(0);
+size_t PARTIAL_HASH_SIZE_ARG(4096);
+size_t TREE_SEGMENT_SIZE_ARG(0);
+std::string IO_POLICY_ARG("cached");
+size_t READAHEAD_ARG(0);
+bool IO_URING_ARG(false);
+std::string DISK_ORDER_ARG("auto");
+std::vector<std::string> DEVICE_THREADS_VEC_ARG;
+bool VERIFY_MD5_LIST_ARG(false);
+bool STREAM_ARG(false);
+fs::path EXPORT_MD5_LIST_ARG;
+fs::path EXPORT_MANIFEST_ARG;
+
+// Thread counts for devices from --device-threads, by device number.
+std::map<u64, size_t> DEVICE_THREAD_COUNT_MAP;
+
+// Algorithm for hashing full file contents, from --hash, --md5 or --md5list.
+HashAlgo HASH_ALGO(HashAlgo::WIDE128);
+
+// How long the prompt waits for new rules to be evaluated before it's shown with the rules still
+// being evaluated. On smaller sets of files, the rules are done by then.
+const std::chrono::milliseconds RULE_EVALUATION_WAIT(250);
+
+// Groups with up to this many distinct files are compared byte by byte instead of being hashed.
+// The files are read side by side, so larger groups would cause too much seeking back and forth.
+const size_t MAX_COMPARED_GROUP_SIZE(3);
 
-typedef std::string Hash;
-
-// Compare functions for regular sort operations do not need any context beyond the value pairs that
-// the sort function passes in. This class is created before the sort and stores GroupMap context,
-// allowing HashToGroupMap by be sorted by FileInfo in the GroupMap.
-template <typename GroupMap> class CompareGroupsByHash {
+// Hold one file entry.
+class FileInfo {
 public:
-  explicit CompareGroupsByHash(GroupMap groupMap) : groupMap(std::move(groupMap))
+  FileInfo(fs::path path, size_t size, const Hash &hash)
+    : path(std::move(path)), size(size), hash(hash)
   {
   }
 
-  // All files in a group share the same size. If the files in the two groups have different sizes,
-  // use that for sorting. If they're the same, fall back to comparing the first path in each
-  // FileVec as a tie breaker. The FileVecs for each group should themselves be sorted first.
-  bool operator()(const Hash &a, const Hash &b) const
+  FileInfo(fs::path path, size_t size) : path(std::move(path)), size(size)
   {
-    auto groupA = groupMap.at(a);
-    auto groupB = groupMap.at(b);
-    if (groupA[0].size == groupB[0].size) {
-      return groupA[0].path > groupB[0].path;
-    }
-    return groupA[0].size > groupB[0].size;
   }
 
-private:
-  GroupMap groupMap;
-};
-
-// Hold one file entry.
-class FileInfo {
-public:
-  FileInfo(fs::path path, size_t size, std::string hash)
-    : path(std::move(path)), size(size), hash(std::move(hash))
+  FileInfo(fs::path path, const DirEntry &dirEntry)
+    : path(std::move(path)), size(dirEntry.size), dev(dirEntry.dev), ino(dirEntry.ino),
+      nlink(dirEntry.nlink), mtime(dirEntry.mtime)
   {
   }
 
-  FileInfo(fs::path path, size_t size) : path(std::move(path)), size(size)
+  // Hard links share an inode. Files with unknown inodes are never considered links.
+  [[nodiscard]] bool isSameInode(const FileInfo &other) const
   {
+    return ino && ino == other.ino && dev == other.dev;
   }
 
   std::string str()
   {
-    return hash.empty() ? fmt::format("{:>14n} {}", size, path.native())
-                        : fmt::format("{:>14n} {} {}", size, std::string(hash), path.native());
+    return hash.empty() ? fmt::format("{:>14L} {}", size, path.native())
+                        : fmt::format("{:>14L} {} {}", size, hash, path.native());
   }
 
   fs::path path;
   size_t size;
-  std::string hash{""};
+  // Identity and modification time of the file. Left at 0 if unknown.
+  u64 dev{0};
+  u64 ino{0};
+  // Number of hard links to the inode, including the ones outside of the search folders.
+  u64 nlink{1};
+  s64 mtime{0};
+  Hash hash;
+  // Hashes of the first and last PARTIAL_HASH_SIZE_ARG bytes. Only used for ruling out candidates.
+  u64 headHash{0};
+  u64 tailHash{0};
+  // Set instead of the hash for files whose contents were compared directly with the other files
+  // in their group. Files with the same matchId have the same contents.
+  u64 matchId{0};
+  // Hashes of the segments of files that were hashed as trees, in file order. Kept so that files
+  // that are only partly the same can be found.
+  std::vector<Hash> segmentHashVec;
+  // Number of the current rules that match the file. Kept up to date as rules are added and
+  // removed, so the rules don't have to be evaluated again each time the file is displayed.
+  u32 ruleMatchCount{0};
 };
 
 typedef std::vector<FileInfo> FileVec;
 
-// Vector of files in one group. Can't be a sequence as iterators into the vector remaining valid
-// even when items are removed.
-typedef std::vector<FileInfo> Group;
+// A group of files is a range of adjacent files in the file table. The table is kept sorted so that
+// files that may be duplicates of each other are next to each other. This lets groups refer to
+// files by index instead of holding copies of them.
+class Group {
+public:
+  Group(size_t beginIdx, size_t endIdx) : beginIdx(beginIdx), endIdx(endIdx)
+  {
+  }
+
+  [[nodiscard]] size_t size() const
+  {
+    return endIdx - beginIdx;
+  }
+
+  size_t beginIdx;
+  size_t endIdx;
+};
+
+// Vec of groups in the order they are displayed. Groups are sorted by file size, which enables us to
+// move back and forth in groups based on file size, and to put the group with the largest files
+// first.
+typedef std::vector<Group> GroupVec;
+
+// The files to hash on one device, and the number of threads that read them. Each device gets its
+// own threads, so a slow disk doesn't hold up the hashing on a fast one, and a disk that can only
+// serve one read at a time isn't made to seek between the reads of several threads.
+class DeviceQueue {
+public:
+  u64 dev{0};
+  std::string name;
+  bool isRotational{false};
+  size_t threadCount{1};
+  std::vector<size_t> fileIdxVec;
+  std::atomic<size_t> nextIdx{0};
+  u64 totalBytes{0};
+  std::atomic<u64> hashedBytes{0};
+  std::chrono::steady_clock::time_point startTime;
+};
+
+typedef std::vector<DeviceQueue> DeviceQueueVec;
+
+// The large files on one device that are hashed as trees. Each file is split into segments that are
+// hashed by all the threads of the device in parallel, so a single large file doesn't leave one
+// thread hashing it long after the others are done. The root hash is the hash of the segment
+// hashes. All files in a group have the same size, so they're all hashed the same way.
+class TreeQueue {
+public:
+  // Files that already have a hash, or have one in the cache, are passed to onHashed right away.
+  TreeQueue(FileVec &fileVec, const std::vector<size_t> &fileIdxVec,
+    std::function<void(FileInfo &, bool)> onHashed);
+  // Hash segments until there are none left to take. Called by each thread of the device. The
+  // segments are taken in the order of the files, so a disk head still sweeps across the disk.
+  void hashSegments();
+  [[nodiscard]] size_t getHashedCount() const;
+  [[nodiscard]] size_t getSegmentCount() const;
+
+private:
+  class Tree {
+  public:
+    size_t fileIdx{0};
+    std::vector<Hash> segmentHashVec;
+    std::atomic<size_t> remainingCount{0};
+    std::atomic<bool> isFailed{false};
+  };
+
+  FileVec &fileVec;
+  std::function<void(FileInfo &, bool)> onHashed;
+  std::vector<Tree> treeVec;
+  // Segments are identified by tree and segment index.
+  std::vector<std::pair<size_t, size_t>> segmentVec;
+  std::atomic<size_t> nextIdx{0};
+  size_t hashedCount{0};
+};
+
+// Compare functions for regular sort operations do not need any context beyond the value pairs that
+// the sort function passes in. This class is created before the sort and refers to the file table,
+// allowing GroupVec to be sorted by the FileInfo in the groups.
+class CompareGroupsBySize {
+public:
+  explicit CompareGroupsBySize(const FileVec &fileVec) : fileVec(fileVec)
+  {
+  }
+
+  // All files in a group share the same size. If the files in the two groups have different sizes,
+  // use that for sorting. If they're the same, fall back to comparing the first path in each group
+  // as a tie breaker. The files in each group should themselves be sorted first.
+  bool operator()(const Group &a, const Group &b) const
+  {
+    const auto &fileA = fileVec[a.beginIdx];
+    const auto &fileB = fileVec[b.beginIdx];
+    if (fileA.size == fileB.size) {
+      return fileA.path > fileB.path;
+    }
+    return fileA.size > fileB.size;
+  }
+
+private:
+  const FileVec &fileVec;
+};
+
+// A file matched by a rule, and the first index of its group in the file table. Groups are referred
+// to by their first index, as their place in the display order changes when groups are added.
+class RuleMatch {
+public:
+  RuleMatch(size_t groupBeginIdx, size_t fileIdx) : groupBeginIdx(groupBeginIdx), fileIdx(fileIdx)
+  {
+  }
+
+  // Groups are ranges in the file table, so ordering by file also keeps the matches of each group
+  // together.
+  bool operator<(const RuleMatch &other) const
+  {
+    return fileIdx < other.fileIdx;
+  }
+
+  size_t groupBeginIdx;
+  size_t fileIdx;
+};
+
+typedef std::vector<RuleMatch> RuleMatchVec;
 
-// Map that files are initially put into when they're found. It both orders and groups files by
-// file_size.
-typedef std::map<size_t, Group> SizeToGroupMap;
+// Counts of the matches found so far while rules are evaluated, which can be read while the
+// evaluation runs. Setting isCancelled makes the evaluation stop early.
+class RuleProgress {
+public:
+  std::atomic<size_t> searchedGroupCount{0};
+  std::atomic<size_t> matchCount{0};
+  std::atomic<u64> matchedBytes{0};
+  std::atomic<bool> isCancelled{false};
+};
 
-// Hash of vectors of files is the map that files are put into after files with unique file lengths
-// are eliminated. It groups files by hash.
-typedef std::unordered_map<Hash, Group> HashToGroupMap;
+// Finds the matches of a new rule on a background thread, so that the prompt doesn't wait while the
+// rule is evaluated against all the files. The matches are only applied to the file table and the
+// stats once the evaluation is done, by the main thread, so the evaluation only reads the paths.
+// The evaluation covers the groups there were when it started, and keeps its own copy of them, as
+// groups that are added later are matched when they're added. Destroying an evaluation that is
+// still running cancels it.
+class RuleEvaluation {
+public:
+  RuleEvaluation(RuleMatcher matcher, const FileVec &fileVec, GroupVec groupVec);
+  ~RuleEvaluation();
+  // Wait for the evaluation to finish for up to the given time. Returns true if it's done.
+  bool waitFor(std::chrono::milliseconds timeout);
+  // Wait for the evaluation to finish and get the matches of each rule in the matcher.
+  std::vector<RuleMatchVec> getMatchVecVec();
+  [[nodiscard]] const RuleProgress &getProgress() const;
+  [[nodiscard]] size_t getGroupCount() const;
 
-// Vec that keeps the order that the group_maps were created in. Because file_map is a map sorted by
-// file_size, group_walker is also sorted. This enables us to move back and forth in groups based on
-// file size, and to put the group with the largest files first.
-typedef std::vector<Hash> GroupsBySizeVec;
+private:
+  RuleMatcher matcher;
+  RuleProgress progress;
+  GroupVec groupVec;
+  std::future<std::vector<RuleMatchVec>> future;
+};
 
+// Each rule keeps the files it was found to match, so a rule can be removed by visiting only those
+// files. The matches refer to files and groups by index, so they are only valid until files are
+// deleted, after which the rules are cleared. A rule that is still being evaluated holds the
+// evaluation, and has only the matches in groups that were added since it started.
 class Rules {
 public:
   void addRegexRule(const std::string &arg)
   {
     assertNotEmpty(arg);
     assertNotExists(regexStrVec, arg);
-    try {
-      regexVec.emplace_back(arg, regbase::perl | regbase::icase);
-    }
-    catch (std::exception &e) {
-      throw std::runtime_error(fmt::format("Invalid regular expression: {}"));
-    }
+    RuleMatcher::compileRegex(arg);
     regexStrVec.push_back(arg);
     pathVec.emplace_back();
+    matchVecVec.emplace_back();
+    evaluationVec.emplace_back();
   }
 
   void addPathRule(const fs::path &arg)
   {
     assertNotEmpty(arg);
     assertNotExists(pathVec, arg);
-    regexVec.emplace_back();
     regexStrVec.emplace_back("");
     pathVec.push_back(arg);
+    matchVecVec.emplace_back();
+    evaluationVec.emplace_back();
   }
 
   void eraseRule(size_t idx)
   {
-    regexVec.erase(regexVec.begin() + idx);
     regexStrVec.erase(regexStrVec.begin() + idx);
     pathVec.erase(pathVec.begin() + idx);
+    matchVecVec.erase(matchVecVec.begin() + idx);
+    evaluationVec.erase(evaluationVec.begin() + idx);
   }
 
   void clear() {
-    regexVec.clear();
     regexStrVec.clear();
     pathVec.clear();
+    matchVecVec.clear();
+    evaluationVec.clear();
   }
 
-  // Determine if fileInfo matches any of the current rules.
-  [[nodiscard]] bool isMatch(const FileInfo &fileInfo) const
+  // Compile the rules from the given index on into a matcher. The matcher numbers the rules from 0.
+  [[nodiscard]] RuleMatcher getMatcher(size_t beginIdx) const
   {
-    size_t idx = 0;
-    for (auto &rule : pathVec) {
-      if (!rule.empty()) {
-        if (fileInfo.path.native() == rule.native()) {
-          return true;
-        }
+    RuleMatcher matcher;
+    for (size_t idx = beginIdx; idx < pathVec.size(); ++idx) {
+      if (!pathVec[idx].empty()) {
+        matcher.addPathRule(pathVec[idx].native());
       }
       else {
-        if (regex_search(fileInfo.path.native(), regexVec[idx])) {
-          return true;
-        }
+        matcher.addRegexRule(regexStrVec[idx]);
       }
-      ++idx;
     }
-    return false;
+    matcher.compile();
+    return matcher;
+  }
+
+  RuleMatchVec &getMatchVec(size_t idx)
+  {
+    return matchVecVec[idx];
+  }
+
+  // Null if the rule is not being evaluated.
+  [[nodiscard]] RuleEvaluation *getEvaluation(size_t idx) const
+  {
+    return evaluationVec[idx].get();
+  }
+
+  void setEvaluation(size_t idx, std::unique_ptr<RuleEvaluation> evaluation)
+  {
+    evaluationVec[idx] = std::move(evaluation);
   }
 
   [[nodiscard]] std::vector<std::string> getRulesForDisplay() const
@@ -179,7 +379,7 @@ public:
     return r;
   }
 
-  size_t getRuleCount()
+  [[nodiscard]] size_t getRuleCount() const
   {
     return pathVec.size();
   }
@@ -201,12 +401,35 @@ public:
   }
 
 private:
-  std::vector<regex> regexVec;
   std::vector<std::string> regexStrVec;
   std::vector<fs::path> pathVec;
+  std::vector<RuleMatchVec> matchVecVec;
+  std::vector<std::unique_ptr<RuleEvaluation>> evaluationVec;
+};
+
+// A directory waiting to be scanned.
+class ScanDir {
+public:
+  ScanDir() = default;
+
+  ScanDir(fs::path path, bool isRecursive) : path(std::move(path)), isRecursive(isRecursive)
+  {
+  }
+
+  fs::path path;
+  bool isRecursive{false};
 };
 
 timer LAST_STATUS_TIME;
+// Serializes status display and other shared state between worker threads.
+std::mutex STATUS_MUTEX;
+// Hashes from earlier runs. Only open if --cache is used.
+HashCache HASH_CACHE;
+// Hashes calculated in this run, for resuming it if it's interrupted. Only open if --checkpoint is
+// used.
+CheckpointJournal CHECKPOINT_JOURNAL;
+// Makes the hashing threads stop taking new files.
+std::atomic<bool> IS_HASHING_STOPPED(false);
 
 class Stats {
 public:
@@ -227,6 +450,17 @@ public:
     groupCount += other.groupCount;
   }
 
+  void operator-=(const Stats &other)
+  {
+    totalCount -= other.totalCount;
+    dupCount -= other.dupCount;
+    markedCount -= other.markedCount;
+    totalBytes -= other.totalBytes;
+    dupBytes -= other.dupBytes;
+    markedBytes -= other.markedBytes;
+    groupCount -= other.groupCount;
+  }
+
   size_t totalCount;
   size_t dupCount;
   size_t markedCount;
@@ -236,51 +470,188 @@ public:
   size_t groupCount;
 };
 
+// The stats of each group and their totals. The interactive loop displays the totals after each
+// command, and summing up all the groups each time would make the prompt slower the more groups
+// there are. Instead, only the groups whose marked files change are counted again, and their old
+// stats are swapped out of the totals for the new ones. Groups are looked up by their first index
+// in the file table, which stays the same when files are deleted from the group.
+class StatsIndex {
+public:
+  StatsIndex(const FileVec &fileVec, const GroupVec &groupVec);
+  void addGroup(const FileVec &fileVec, const Group &group);
+  void removeGroup(const Group &group);
+  // Count the group with the given first index again after the match counts of its files have
+  // changed.
+  void updateGroup(const FileVec &fileVec, size_t beginIdx);
+  [[nodiscard]] const Stats &getGroupStats(const Group &group) const;
+  [[nodiscard]] const Stats &getTotalStats() const;
+
+private:
+  class GroupStats {
+  public:
+    size_t endIdx;
+    Stats stats;
+  };
+
+  std::unordered_map<size_t, GroupStats> groupStatsMap;
+  Stats totalStats;
+};
+
+// Hashes the candidate groups on a background thread while the interactive session runs, for
+// --stream. The groups are hashed one after the other, starting with the ones that could free the
+// most space, and each group is handed over to the session once all of its files are hashed. The
+// hashing threads don't touch the files of a group after that, so the main thread can sort them
+// into groups by hash while the rest of the files are being hashed. The file table must not be
+// resized while hashing runs. Destroying a stream that is still hashing stops it.
+class HashStream {
+public:
+  HashStream(FileVec &fileVec, GroupVec candidateGroupVec);
+  ~HashStream();
+  // Take the candidate groups whose files have all been hashed since the last call.
+  GroupVec takeHashedGroups();
+  // Wait until there are hashed groups to take or hashing is done, for up to the given time.
+  void waitForGroups(std::chrono::milliseconds timeout);
+  // True when all the groups have been hashed and taken.
+  [[nodiscard]] bool isDone();
+  // Stop hashing once the files that are being read are done, and wait for the hashing threads.
+  // Rethrows an error that stopped the hashing.
+  void stop();
+  [[nodiscard]] u64 getHashedBytes() const;
+  [[nodiscard]] u64 getTotalBytes() const;
+  [[nodiscard]] size_t getRemainingGroupCount() const;
+
+private:
+  void onFileDone(size_t fileIdx, bool isUnhashed);
+
+  const FileVec &fileVec;
+  GroupVec candidateGroupVec;
+  // The candidate group of each file in the table, by index.
+  std::vector<size_t> fileGroupIdxVec;
+  // The files left to hash in each candidate group.
+  std::unique_ptr<std::atomic<size_t>[]> remainingCountVec;
+  std::atomic<u64> hashedBytes{0};
+  u64 totalBytes{0};
+  size_t takenCount{0};
+  std::mutex mutex;
+  std::condition_variable hashedCondition;
+  GroupVec hashedGroupVec;
+  bool isHashingDone{false};
+  std::future<void> future;
+};
+
 void verifyDirPaths();
 bool isInvalidDirPath(const fs::path &p);
 FileVec findAllFiles();
-void addPath(FileVec &fileVec, const fs::path &path, const bool &recursive);
+void scanDirs(FileVec &fileVec, const std::vector<ScanDir> &rootDirVec);
+void scanDir(WorkStealingQueue<ScanDir> &dirQueue, size_t workerIdx, FileVec &fileVec,
+  const ScanDir &scanDir);
+void removeDuplicatePaths(FileVec &fileVec);
 void addMd5File(FileVec &fileVec, const fs::path &md5DeepPath);
-void addFile(FileVec &fileVec, const fs::path &filePath);
-void displayFindStatus(const FileVec &fileVec, bool forceDisplay = false);
+void addManifest(FileVec &fileVec, const fs::path &manifestPath);
+void verifyListedFiles(FileVec &fileVec, size_t beginIdx, const fs::path &listPath);
+bool addFile(FileVec &fileVec, const fs::path &filePath);
+bool addFile(FileVec &fileVec, FileInfo fileInfo);
+void displayFindStatus(size_t foundCount, bool forceDisplay = false);
+// Write the file table with full hashes to the manifests.
+void exportManifests(FileVec &fileVec);
 // Group files by size and remove single item groups (files with unique sizes can't have dups).
-SizeToGroupMap groupFilesBySize(const FileVec &fileVec);
-template <typename GroupMap> void removeSingleItemGroups(GroupMap &groupMap);
+GroupVec groupFilesBySize(FileVec &fileVec);
+template <typename KeyFn> GroupVec groupFiles(FileVec &fileVec, KeyFn keyFn);
+void removeSingleItemGroups(FileVec &fileVec, GroupVec &groupVec);
+bool hasMultipleInodes(const FileVec &fileVec, const Group &group);
+std::vector<size_t> getLinkLeaderIdxVec(const FileVec &fileVec);
+// Narrow the candidates down by hashing only the first and last block of each file.
+GroupVec filterByPartialHash(FileVec &fileVec, const GroupVec &groupVec, bool isTail);
+bool isPartialHashUseful(const FileVec &fileVec, const Group &group, bool isTail);
+u64 calculateBlockHash(const FileInfo &fileInfo, bool isTail, std::atomic<size_t> &readBytes);
+
+// Compare the files in small groups directly instead of hashing them.
+GroupVec compareSmallGroups(FileVec &fileVec, const GroupVec &groupVec);
+bool isComparisonUseful(
+  const FileVec &fileVec, const Group &group, const std::vector<size_t> &leaderIdxVec);
+void compareFiles(FileVec &fileVec, const std::vector<size_t> &fileIdxVec,
+  std::atomic<u64> &nextMatchId, std::atomic<size_t> &readBytes, std::vector<char> &isFailedVec);
+// Hash cache.
+void openHashCache();
+void closeHashCache();
+HashCache::Key getCacheKey(const FileInfo &fileInfo, HashCache::Algo algo, u32 param = 0);
+HashCache::Algo getCacheAlgo();
+// Checkpoint journal.
+void openCheckpointJournal();
+void closeCheckpointJournal();
+void resumeFromCheckpoint(FileVec &fileVec);
 // Hash all remaining files, as they may have dups.
 void hashAll(FileVec &fileVec);
+void hashFiles(FileVec &fileVec, const std::vector<size_t> &fileIdxVec,
+  const std::function<void(size_t fileIdx, bool isUnhashed)> &onFileDone);
+void hashMultiBuffer(FileVec &fileVec, const std::vector<size_t> &fileIdxVec,
+  std::atomic<size_t> &nextIdx, const std::function<void(FileInfo &, bool)> &onHashed);
+bool hashUring(FileVec &fileVec, const std::vector<size_t> &fileIdxVec,
+  std::atomic<size_t> &nextIdx, const std::function<void(FileInfo &, bool)> &onHashed);
+bool isTreeHashed(const FileInfo &fileInfo);
+u64 getTreeSegmentSize();
+void orderByDiskLayout(const FileVec &fileVec, std::vector<size_t> &fileIdxVec);
+DeviceQueueVec getDeviceQueueVec(const FileVec &fileVec, const std::vector<size_t> &fileIdxVec);
+size_t getDeviceThreadCount(u64 dev, bool isRotational);
+void displayReadStats();
 void calculateHash(FileInfo &fileInfo);
+bool findCachedHash(FileInfo &fileInfo);
+void storeHash(FileInfo &fileInfo, const Hash &hash);
+HashCache::Key getHashCacheKey(const FileInfo &fileInfo);
 void displayHashStatus(const FileInfo &fileInfo, size_t accumulatedSize, size_t totalSize,
-  size_t fileCount, size_t fileIdx);
-size_t getTotalSizeOfUnhashed(FileVec &fileVec);
+  size_t fileCount, size_t fileIdx, const DeviceQueueVec &deviceQueueVec);
+size_t getTotalSizeOfUnhashed(const FileVec &fileVec, const std::vector<size_t> &fileIdxVec);
+std::vector<size_t> getIdxVecSortedByPath(const FileVec &fileVec);
+size_t getThreadCount();
 // Group files again, this time by hash, and again remove single item groups.
-HashToGroupMap groupFilesByHash(const FileVec &fileVec);
+GroupVec groupFilesByHash(FileVec &fileVec);
+// Groups confirmed while hashing runs in the background.
+GroupVec groupHashedFiles(FileVec &fileVec, const Group &candidateGroup);
+void addHashedGroups(HashStream &hashStream, FileVec &fileVec, GroupVec &groupVec, Rules &rules,
+  StatsIndex &statsIndex, size_t &groupIdx);
+void displayHashStreamStatus(const HashStream &hashStream);
 // Rules.
-void addRulesFromCommandLine(Rules &rules);
+void addRulesFromCommandLine(
+  Rules &rules, FileVec &fileVec, const GroupVec &groupVec, StatsIndex &statsIndex);
+void applyRules(Rules &rules, size_t beginRuleIdx, FileVec &fileVec, const GroupVec &groupVec,
+  StatsIndex &statsIndex);
+std::vector<RuleMatchVec> findRuleMatches(const RuleMatcher &matcher, const FileVec &fileVec,
+  const GroupVec &groupVec, RuleProgress &progress);
+void commitRuleMatches(Rules &rules, size_t beginRuleIdx, std::vector<RuleMatchVec> matchVecVec,
+  FileVec &fileVec, StatsIndex &statsIndex);
+void collectRuleEvaluations(Rules &rules, FileVec &fileVec, StatsIndex &statsIndex, bool isWait);
+void applyPathRule(
+  Rules &rules, const Group &group, size_t fileIdx, FileVec &fileVec, StatsIndex &statsIndex);
+void eraseRule(Rules &rules, size_t ruleIdx, FileVec &fileVec, StatsIndex &statsIndex);
 // Add rules interactively.
-void sortAllFileInfoVec(HashToGroupMap &hashToGroupMap);
-GroupsBySizeVec sortGroupsBySize(const HashToGroupMap &hashToGroupMap);
-void addRulesInteractive(Rules &rules, HashToGroupMap &groupMap);
+void sortAllFileInfoVec(FileVec &fileVec, const GroupVec &groupVec);
+void sortGroupsBySize(const FileVec &fileVec, GroupVec &groupVec);
+void sortGroupsByIdx(GroupVec &groupVec);
+void addRulesInteractive(Rules &rules, FileVec &fileVec, GroupVec &groupVec,
+  StatsIndex &statsIndex, HashStream *hashStream);
 bool isInt(const std::string &cmd);
 size_t argToIdx(const std::string &arg, const size_t &maxIdx);
-void refreshGroups(GroupsBySizeVec &groupsBySize, HashToGroupMap &groupMap);
 void commandPrompt(std::string &cmd, std::string &arg, size_t groupIdx, size_t groupCount);
 void displayRules(const Rules &rules);
-void displayGroup(const FileVec &fileVec, const Rules &rules, size_t groupIdx, size_t groupCount);
+std::string getEvaluationStatus(const RuleEvaluation &evaluation);
+void displayGroup(const FileVec &fileVec, const Group &group, const StatsIndex &statsIndex,
+  size_t groupIdx, size_t groupCount);
+std::vector<size_t> getLinkNumVec(const FileVec &fileVec, const Group &group);
 void displayHelp();
 void displayTotalStats(const Stats &stats);
 // Delete files marked by the rules.
 bool confirmDeletePrompt(const Stats &totalStats);
-void deleteMarkedFiles(HashToGroupMap &groupMap, const Rules &rules);
+void deleteMarkedFiles(FileVec &fileVec, GroupVec &groupVec, Rules &rules, StatsIndex &statsIndex);
 bool deleteFile(const FileInfo &fileInfo);
 void displayDeleteStatus(const Stats &totalStats, size_t deleteIdx, size_t deletedCount);
 // Misc.
-Stats getGroupStats(const FileVec &fileVec, const Rules &rules);
-Stats getTotalStats(const HashToGroupMap &groupMap, const Rules &rules);
+Stats getGroupStats(const FileVec &fileVec, const Group &group);
 // Locale and command line.
 void setupLocale();
 void parseCommandLine(int argc, char **argv);
 void procCommand(size_t &groupIdx, bool &doDisplayHelp, Rules &rules, const Stats &totalStats,
-  const FileVec &groupFileVec, const std::string &cmd, const std::string &arg, HashToGroupMap &groupMap);
+  const Group &group, const std::string &cmd, const std::string &arg, FileVec &fileVec,
+  GroupVec &groupVec, StatsIndex &statsIndex);
 
 // Print only when called with --verbose.
 // TODO: Replace with logging.
@@ -291,6 +662,14 @@ template <typename... Args> void print_verbose(const char *fmt, Args &&... args)
   }
 }
 
+// Print only when called with --debug.
+template <typename... Args> void print_debug(const char *fmt, Args &&... args)
+{
+  if (DEBUG_ARG) {
+    fmt::print(fmt, std::forward<Args>(args)...);
+  }
+}
+
 // Print only when not called with --quiet
 // TODO: Replace with logging.
 template <typename... Args> void print_quiet(const char *fmt, Args &&... args)
@@ -300,30 +679,81 @@ template <typename... Args> void print_quiet(const char *fmt, Args &&... args)
   }
 }
 
+// Run fn on each of the worker threads and wait for all of them to finish. fn receives the index of
+// the worker and is responsible for pulling its own work items, typically by incrementing a shared
+// atomic index.
+template <typename Fn> void runWorkers(Fn fn, size_t threadCount = getThreadCount())
+{
+  std::vector<std::thread> threadVec;
+  for (size_t workerIdx = 0; workerIdx < threadCount; ++workerIdx) {
+    threadVec.emplace_back(fn, workerIdx);
+  }
+  for (auto &thread : threadVec) {
+    thread.join();
+  }
+}
+
 int main(int argc, char *argv[])
 {
   setupLocale();
   parseCommandLine(argc, argv);
   verifyDirPaths();
+  openHashCache();
+  openCheckpointJournal();
+  // The file table. Each stage below sorts it and removes the files that can no longer have
+  // duplicates, so only the remaining candidates are passed on to the next stage.
   auto fileVec = findAllFiles();
-  auto sizeToGroupMap = groupFilesBySize(fileVec);
-  removeSingleItemGroups(sizeToGroupMap);
-  hashAll(fileVec);
-  auto hashToGroupMap = groupFilesByHash(fileVec);
-  sortAllFileInfoVec(hashToGroupMap);
+  resumeFromCheckpoint(fileVec);
+  exportManifests(fileVec);
+  auto groupVec = groupFilesBySize(fileVec);
+  groupVec = filterByPartialHash(fileVec, groupVec, false);
+  groupVec = filterByPartialHash(fileVec, groupVec, true);
+  groupVec = compareSmallGroups(fileVec, groupVec);
+  // With --stream, the session starts right away with no groups, and the groups are added as they
+  // are confirmed by the hashing in the background.
+  std::unique_ptr<HashStream> hashStream;
+  if (STREAM_ARG) {
+    hashStream = std::make_unique<HashStream>(fileVec, std::move(groupVec));
+    groupVec.clear();
+  }
+  else {
+    hashAll(fileVec);
+    displayReadStats();
+    closeCheckpointJournal();
+    closeHashCache();
+    groupVec = groupFilesByHash(fileVec);
+  }
+  StatsIndex statsIndex(fileVec, groupVec);
   // Vec of marking rules.
   Rules rules;
-  addRulesFromCommandLine(rules);
+  addRulesFromCommandLine(rules, fileVec, groupVec, statsIndex);
   // Set up rules for selecting files to delete.
   if (!AUTOMATIC_ARG) {
-    addRulesInteractive(rules, hashToGroupMap);
+    addRulesInteractive(rules, fileVec, groupVec, statsIndex, hashStream.get());
   }
   else {
-    deleteMarkedFiles(hashToGroupMap, rules);
+    deleteMarkedFiles(fileVec, groupVec, rules, statsIndex);
+  }
+  // Hashing may still be running if the session was left early. The hashes calculated so far are
+  // kept in the cache and the checkpoint journal, also if hashing ended with an error.
+  bool isHashingFailed = false;
+  if (hashStream) {
+    try {
+      hashStream->stop();
+    }
+    catch (const std::exception &e) {
+      fmt::print("\nError: {}\n", e.what());
+      isHashingFailed = true;
+    }
+    displayReadStats();
+    closeCheckpointJournal();
+    closeHashCache();
   }
   // Show final stats after deletes.
-  auto totalStats = getTotalStats(hashToGroupMap, rules);
-  displayTotalStats(totalStats);
+  displayTotalStats(statsIndex.getTotalStats());
+  if (isHashingFailed) {
+    exit(1);
+  }
   // Success.
   exit(0);
 }
@@ -339,291 +769,1715 @@ void verifyDirPaths()
     isInvalid |= isInvalidDirPath(p);
   }
   for (auto &p : MD5_PATH_VEC_ARG) {
-    isInvalid |= isInvalidDirPath(p);
+    if (!is_regular_file(p)) {
+      fmt::print("Invalid md5 list: {}\n", p.native());
+      isInvalid = true;
+    }
+  }
+  for (auto &p : MANIFEST_PATH_VEC_ARG) {
+    if (!is_regular_file(p)) {
+      fmt::print("Invalid manifest: {}\n", p.native());
+      isInvalid = true;
+    }
   }
   if (isInvalid) {
     exit(1);
   }
 }
 
-bool isInvalidDirPath(const fs::path &p)
+bool isInvalidDirPath(const fs::path &p)
+{
+  if (!is_directory(p)) {
+    fmt::print("Invalid path: {}\n", p.native());
+    return true;
+  }
+  return false;
+}
+
+// Create vector of files to check for duplicates.
+FileVec findAllFiles()
+{
+  FileVec fileVec;
+  std::vector<ScanDir> rootDirVec;
+  // Add all files in search folders, non-recursive.
+  for (auto &p : PATH_VEC_ARG) {
+    print_verbose("\nProcessing non-recursive: {}\n", p.native());
+    rootDirVec.emplace_back(canonical(p), false);
+  }
+  // Add all files in search folders, recursive.
+  for (auto &p : RECURSIVE_PATH_VEC_ARG) {
+    print_verbose("\nProcessing recursive: {}\n", p.native());
+    rootDirVec.emplace_back(canonical(p), true);
+  }
+  scanDirs(fileVec, rootDirVec);
+  // Add all files provided as md5 vectors.
+  for (auto &p : MD5_PATH_VEC_ARG) {
+    print_verbose("\nProcessing MD5 file: {}\n", p.native());
+    addMd5File(fileVec, p);
+  }
+  // Add all files in binary manifests.
+  for (auto &p : MANIFEST_PATH_VEC_ARG) {
+    print_verbose("\nProcessing manifest: {}\n", p.native());
+    addManifest(fileVec, p);
+  }
+  removeDuplicatePaths(fileVec);
+  displayFindStatus(fileVec.size(), true);
+  return fileVec;
+}
+
+// Scan the folders on the worker threads. The workers pull directories from work-stealing deques,
+// so a worker that finishes its part of the tree helps out with the rest instead of idling. Each
+// worker collects files in its own FileVec. The merged list is in no particular order until
+// removeDuplicatePaths() sorts it by path, after which the result doesn't depend on how the
+// directories were divided up between the workers.
+void scanDirs(FileVec &fileVec, const std::vector<ScanDir> &rootDirVec)
+{
+  WorkStealingQueue<ScanDir> dirQueue(getThreadCount());
+  for (size_t rootIdx = 0; rootIdx < rootDirVec.size(); ++rootIdx) {
+    dirQueue.push(rootIdx % getThreadCount(), rootDirVec[rootIdx]);
+  }
+  std::vector<FileVec> workerFileVec(getThreadCount());
+  runWorkers([&](size_t workerIdx) {
+    ScanDir dir;
+    while (dirQueue.pop(workerIdx, dir)) {
+      scanDir(dirQueue, workerIdx, workerFileVec[workerIdx], dir);
+      dirQueue.done();
+    }
+  });
+  for (auto &workerVec : workerFileVec) {
+    std::move(std::begin(workerVec), std::end(workerVec), std::back_inserter(fileVec));
+    FileVec().swap(workerVec);
+  }
+}
+
+// Add the files in a directory and queue its subdirectories if the scan is recursive. The root
+// folders have been made canonical and symlinks are not followed, so the paths of the files are
+// canonical too, and are built by appending names instead of resolving each of them.
+void scanDir(WorkStealingQueue<ScanDir> &dirQueue, size_t workerIdx, FileVec &fileVec,
+  const ScanDir &dir)
+{
+  static std::atomic<size_t> foundCount(0);
+  print_verbose("Entering dir: {}\n", dir.path.native());
+  DirEntryVec dirEntryVec;
+  try {
+    readDirEntries(dir.path, dirEntryVec);
+  }
+  catch (const std::exception &e) {
+    std::lock_guard<std::mutex> lock(STATUS_MUTEX);
+    fmt::print("\nIgnored dir: {}\n", dir.path.native());
+    print_verbose("Cause: {}\n", e.what());
+    return;
+  }
+  for (const auto &dirEntry : dirEntryVec) {
+    auto path = dir.path / dirEntry.name;
+    // Do not follow symlinks and junctions.
+    if (dirEntry.type == DirEntry::OTHER) {
+      print_verbose("Ignored special file: {}\n", path.native());
+    }
+    else if (dirEntry.type == DirEntry::FAILED) {
+      std::lock_guard<std::mutex> lock(STATUS_MUTEX);
+      fmt::print("\nIgnored file: {}\n", path.native());
+      print_verbose("Cause: {}\n", dirEntry.error);
+    }
+    else if (dirEntry.type == DirEntry::REGULAR) {
+      if (addFile(fileVec, FileInfo(path, dirEntry))) {
+        auto count = ++foundCount;
+        std::lock_guard<std::mutex> lock(STATUS_MUTEX);
+        displayFindStatus(count);
+      }
+    }
+    else if (dir.isRecursive) {
+      dirQueue.push(workerIdx, ScanDir(path, true));
+    }
+  }
+}
+
+// If one search folder is inside another, the files in it are found twice. Keep only the first
+// copy, as a file listed twice would look like a duplicate of itself. Requires sorting by path. The
+// indexes are sorted instead of the files, and each file is then moved only once, to its place.
+void removeDuplicatePaths(FileVec &fileVec)
+{
+  std::vector<size_t> fileIdxVec(fileVec.size());
+  for (size_t fileIdx = 0; fileIdx < fileVec.size(); ++fileIdx) {
+    fileIdxVec[fileIdx] = fileIdx;
+  }
+  auto isPathLess = [&](size_t a, size_t b) {
+    return fileVec[a].path.native() < fileVec[b].path.native();
+  };
+  // The workers sort a range each, and the ranges are then merged. Both steps are stable, so the
+  // first copy of a path stays first.
+  auto threadCount = getThreadCount();
+  auto rangeSize = std::max<size_t>((fileIdxVec.size() + threadCount - 1) / threadCount, 1);
+  auto idxBegin = std::begin(fileIdxVec);
+  runWorkers(
+    [&](size_t workerIdx) {
+      auto beginIdx = std::min(workerIdx * rangeSize, fileIdxVec.size());
+      auto endIdx = std::min(beginIdx + rangeSize, fileIdxVec.size());
+      std::stable_sort(idxBegin + beginIdx, idxBegin + endIdx, isPathLess);
+    },
+    threadCount);
+  for (auto width = rangeSize; width < fileIdxVec.size(); width *= 2) {
+    for (size_t beginIdx = 0; beginIdx + width < fileIdxVec.size(); beginIdx += width * 2) {
+      auto endIdx = std::min(beginIdx + width * 2, fileIdxVec.size());
+      std::inplace_merge(
+        idxBegin + beginIdx, idxBegin + beginIdx + width, idxBegin + endIdx, isPathLess);
+    }
+  }
+  // Follow each cycle of the permutation, filling each place with the file that belongs there.
+  for (size_t dstIdx = 0; dstIdx < fileVec.size(); ++dstIdx) {
+    if (fileIdxVec[dstIdx] == dstIdx) {
+      continue;
+    }
+    auto fileInfo = std::move(fileVec[dstIdx]);
+    auto idx = dstIdx;
+    while (fileIdxVec[idx] != dstIdx) {
+      auto srcIdx = fileIdxVec[idx];
+      fileVec[idx] = std::move(fileVec[srcIdx]);
+      fileIdxVec[idx] = idx;
+      idx = srcIdx;
+    }
+    fileVec[idx] = std::move(fileInfo);
+    fileIdxVec[idx] = idx;
+  }
+  auto endIter = std::unique(std::begin(fileVec), std::end(fileVec),
+    [](const FileInfo &a, const FileInfo &b) { return a.path.native() == b.path.native(); });
+  auto removedCount = std::end(fileVec) - endIter;
+  fileVec.erase(endIter, std::end(fileVec));
+  if (removedCount) {
+    print_verbose("\nSkipped {:L} files that were found more than once\n", removedCount);
+  }
+}
+
+// Add the files in a list written by md5deep -zr, with the sizes and hashes from the list. The
+// files themselves are not touched, so they're taken to be unchanged since the list was written,
+// unless --verify-md5list is used. Relative paths are taken to be relative to the current folder.
+void addMd5File(FileVec &fileVec, const fs::path &md5DeepPath)
+{
+  auto beginIdx = fileVec.size();
+  try {
+    // Looked up once, as fs::absolute() would otherwise look it up again for every line.
+    auto currentPath = fs::current_path();
+    readMd5List(
+      md5DeepPath,
+      [&](u64 size, const Hash &hash, const std::string &path) {
+        addFile(fileVec, FileInfo(fs::absolute(path, currentPath), size, hash));
+        // Checking the time for every line would take longer than parsing it.
+        if (!(fileVec.size() % 65536)) {
+          displayFindStatus(fileVec.size());
+        }
+      },
+      [&](size_t lineNum, const std::string &line) {
+        fmt::print("\nError: Malformed line {:L} in md5 file: {}\n", lineNum, md5DeepPath.native());
+        fmt::print("Line: {}\n", line);
+      });
+  }
+  catch (std::exception &e) {
+    fmt::print("\nError: Couldn't read md5 file: {}\n", md5DeepPath.native());
+    print_verbose("Cause: {}\n", e.what());
+    return;
+  }
+  if (VERIFY_MD5_LIST_ARG) {
+    verifyListedFiles(fileVec, beginIdx, md5DeepPath);
+  }
+}
+
+// Add the files in a manifest written by --export-manifest, with their identity and modification
+// time. The hashes are only used if they were calculated the same way as in this run.
+void addManifest(FileVec &fileVec, const fs::path &manifestPath)
+{
+  auto beginIdx = fileVec.size();
+  try {
+    Manifest manifest(manifestPath);
+    auto isAlgoSame = manifest.getAlgoName() == getHashAlgoName(HASH_ALGO);
+    if (!isAlgoSame) {
+      print_quiet("\nManifest has {} hashes, so its files will be hashed again: {}\n",
+        manifest.getAlgoName(), manifestPath.native());
+    }
+    auto manifestSegmentSize = manifest.getTreeSegmentSize();
+    for (size_t row = 0; row < manifest.size(); ++row) {
+      auto entry = manifest.getEntry(row);
+      FileInfo fileInfo(fs::path(std::string(entry.path)), entry.size);
+      fileInfo.dev = entry.dev;
+      fileInfo.ino = entry.ino;
+      fileInfo.mtime = entry.mtime;
+      // Tree hashes depend on the segment size.
+      auto isManifestTree = manifestSegmentSize && entry.size > manifestSegmentSize;
+      if (isAlgoSame && isManifestTree == isTreeHashed(fileInfo) &&
+        (!isManifestTree || manifestSegmentSize == getTreeSegmentSize())) {
+        fileInfo.hash = entry.hash;
+      }
+      addFile(fileVec, std::move(fileInfo));
+      if (!(fileVec.size() % 65536)) {
+        displayFindStatus(fileVec.size());
+      }
+    }
+  }
+  catch (std::exception &e) {
+    fmt::print("\nError: Couldn't read manifest: {}\n", manifestPath.native());
+    print_verbose("Cause: {}\n", e.what());
+    return;
+  }
+  if (VERIFY_MD5_LIST_ARG) {
+    verifyListedFiles(fileVec, beginIdx, manifestPath);
+  }
+}
+
+// Stat the files imported from a list, on the worker threads. Files whose size or modification time
+// has changed lose their imported hash and are hashed again. md5deep doesn't record modification
+// times, so for files from md5 lists, that means files that were modified after the list was
+// written. Files that are gone are dropped. The other files keep their hash, and get the identity
+// and modification time that found files have, so hard links are detected and the hash cache works
+// for them.
+void verifyListedFiles(FileVec &fileVec, size_t beginIdx, const fs::path &listPath)
+{
+  auto listMtime = statPath(listPath).mtime;
+  std::vector<char> isGoneVec(fileVec.size() - beginIdx, false);
+  std::atomic<size_t> nextIdx(beginIdx);
+  std::atomic<size_t> staleCount(0);
+  runWorkers([&](size_t) {
+    for (size_t fileIdx; (fileIdx = nextIdx++) < fileVec.size();) {
+      auto &fileInfo = fileVec[fileIdx];
+      DirEntry dirEntry;
+      try {
+        dirEntry = statPath(fileInfo.path);
+      }
+      catch (std::exception &e) {
+        std::lock_guard<std::mutex> lock(STATUS_MUTEX);
+        print_verbose("Gone: {}\nCause: {}\n", fileInfo.path.native(), e.what());
+      }
+      if (dirEntry.type != DirEntry::REGULAR) {
+        isGoneVec[fileIdx - beginIdx] = true;
+        continue;
+      }
+      auto isModified =
+        fileInfo.mtime ? dirEntry.mtime != fileInfo.mtime : dirEntry.mtime > listMtime;
+      if (dirEntry.size != fileInfo.size || isModified) {
+        if (VERBOSE_ARG) {
+          std::lock_guard<std::mutex> lock(STATUS_MUTEX);
+          fmt::print("Stale: {}\n", fileInfo.str());
+        }
+        fileInfo = FileInfo(fileInfo.path, dirEntry);
+        ++staleCount;
+        continue;
+      }
+      auto hash = fileInfo.hash;
+      fileInfo = FileInfo(fileInfo.path, dirEntry);
+      fileInfo.hash = hash;
+    }
+  });
+  size_t goneCount = 0;
+  size_t dstIdx = beginIdx;
+  for (size_t fileIdx = beginIdx; fileIdx < fileVec.size(); ++fileIdx) {
+    if (isGoneVec[fileIdx - beginIdx]) {
+      ++goneCount;
+      continue;
+    }
+    if (dstIdx != fileIdx) {
+      fileVec[dstIdx] = std::move(fileVec[fileIdx]);
+    }
+    ++dstIdx;
+  }
+  fileVec.erase(std::begin(fileVec) + dstIdx, std::end(fileVec));
+  print_quiet("\nVerified {}: {:L} files changed, {:L} files gone\n", listPath.native(),
+    staleCount.load(), goneCount);
+}
+
+// Add a file by path. The path may be relative or contain symlinks, so it's made canonical first.
+bool addFile(FileVec &fileVec, const fs::path &filePath)
+{
+  auto absFilePath = canonical(filePath);
+  return addFile(fileVec, FileInfo(absFilePath, statPath(absFilePath)));
+}
+
+// Add a file unless it's filtered out by size. Returns true if the file was added.
+bool addFile(FileVec &fileVec, FileInfo fileInfo)
+{
+  auto fileSize = fileInfo.size;
+  // Filter small files if requested.
+  if (IGNORE_SMALLER_ARG != (size_t)-1 && fileSize <= IGNORE_SMALLER_ARG) {
+    print_verbose(
+      "Ignored small file (< {:L}): {:L} {}\n", IGNORE_SMALLER_ARG, fileSize, fileInfo.path.native());
+    return false;
+  }
+  // Filter large files if requested.
+  if (IGNORE_LARGER_ARG != (size_t)-1 && fileSize >= IGNORE_LARGER_ARG) {
+    print_verbose(
+      "Ignored large file (> {:L}): {:L} {}\n", IGNORE_LARGER_ARG, fileSize, fileInfo.path.native());
+    return false;
+  }
+  // Add file. The line is only formatted when it's printed, as that takes longer than adding the
+  // file to the table.
+  if (VERBOSE_ARG) {
+    fmt::print("Found: {}\n", fileInfo.str());
+  }
+  fileVec.push_back(std::move(fileInfo));
+  return true;
+}
+
+// Display status if more than one second has elapsed.
+void displayFindStatus(size_t foundCount, bool forceDisplay)
+{
+  if (forceDisplay || (!QUIET_ARG && LAST_STATUS_TIME.elapsed() >= 1.0)) {
+    print_quiet("\nFiles found: {:L}\n", foundCount);
+    LAST_STATUS_TIME.restart();
+  }
+}
+
+// Manifests list every file, so all the files are hashed first, not only the ones that may have
+// duplicates. The hashes then carry over to the rest of the run. Files that couldn't be hashed are
+// left out.
+void exportManifests(FileVec &fileVec)
+{
+  if (EXPORT_MD5_LIST_ARG.empty() && EXPORT_MANIFEST_ARG.empty()) {
+    return;
+  }
+  hashAll(fileVec);
+  std::vector<size_t> fileIdxVec;
+  for (size_t fileIdx = 0; fileIdx < fileVec.size(); ++fileIdx) {
+    if (!fileVec[fileIdx].hash.empty()) {
+      fileIdxVec.push_back(fileIdx);
+    }
+  }
+  auto rowFn = [&](size_t row) {
+    const auto &fileInfo = fileVec[fileIdxVec[row]];
+    ManifestEntry entry;
+    entry.path = fileInfo.path.native();
+    entry.size = fileInfo.size;
+    entry.dev = fileInfo.dev;
+    entry.ino = fileInfo.ino;
+    entry.mtime = fileInfo.mtime;
+    entry.hash = fileInfo.hash;
+    return entry;
+  };
+  if (!EXPORT_MD5_LIST_ARG.empty()) {
+    try {
+      auto skippedCount = writeMd5List(EXPORT_MD5_LIST_ARG, fileIdxVec.size(), rowFn);
+      print_quiet("\nExported {:L} files to md5 list: {}\n", fileIdxVec.size() - skippedCount,
+        EXPORT_MD5_LIST_ARG.native());
+      if (skippedCount) {
+        fmt::print(
+          "\nSkipped {:L} files with line breaks in their paths in md5 list\n", skippedCount);
+      }
+    }
+    catch (std::exception &e) {
+      fmt::print("\nError: Couldn't export md5 list: {}\n", EXPORT_MD5_LIST_ARG.native());
+      print_verbose("Cause: {}\n", e.what());
+    }
+  }
+  if (!EXPORT_MANIFEST_ARG.empty()) {
+    try {
+      writeManifest(EXPORT_MANIFEST_ARG, getHashAlgoName(HASH_ALGO), getTreeSegmentSize(),
+        fileIdxVec.size(), rowFn);
+      print_quiet("\nExported {:L} files to manifest: {}\n", fileIdxVec.size(),
+        EXPORT_MANIFEST_ARG.native());
+    }
+    catch (std::exception &e) {
+      fmt::print("\nError: Couldn't export manifest: {}\n", EXPORT_MANIFEST_ARG.native());
+      print_verbose("Cause: {}\n", e.what());
+    }
+  }
+}
+
+GroupVec groupFilesBySize(FileVec &fileVec)
+{
+  size_t totalBytes = 0;
+  for (const auto &fileInfo : fileVec) {
+    totalBytes += fileInfo.size;
+  }
+  auto groupVec = groupFiles(fileVec, [](const FileInfo &f) { return f.size; });
+  if (DEBUG_ARG) {
+    for (const auto &fileInfo : fileVec) {
+      totalBytes -= fileInfo.size;
+    }
+    print_debug("\nSize stage:\n");
+    print_debug("{:>14L} bytes avoided reading in files with unique sizes\n", totalBytes);
+  }
+  return groupVec;
+}
+
+// Sort the file table by key and return the ranges of files that share a key. Files that don't
+// share their key with any other file can't have duplicates, so they are removed from the table.
+template <typename KeyFn> GroupVec groupFiles(FileVec &fileVec, KeyFn keyFn)
+{
+  std::sort(std::begin(fileVec), std::end(fileVec),
+    [&](const FileInfo &a, const FileInfo &b) { return keyFn(a) < keyFn(b); });
+  GroupVec groupVec;
+  size_t beginIdx = 0;
+  for (size_t fileIdx = 1; fileIdx <= fileVec.size(); ++fileIdx) {
+    if (fileIdx == fileVec.size() || keyFn(fileVec[fileIdx]) != keyFn(fileVec[beginIdx])) {
+      groupVec.emplace_back(beginIdx, fileIdx);
+      beginIdx = fileIdx;
+    }
+  }
+  removeSingleItemGroups(fileVec, groupVec);
+  return groupVec;
+}
+
+// Remove groups with only one item. These file in the group has unique file size or hash so cannot
+// have duplicates. Groups where all the files are hard links to the same inode are removed as well,
+// since deleting any of them would not free any space. The file table is compacted in place,
+// keeping the order of the remaining files. Afterwards, the groups are in the same order as in the
+// table.
+void removeSingleItemGroups(FileVec &fileVec, GroupVec &groupVec)
+{
+  sortGroupsByIdx(groupVec);
+  size_t removedCount = 0;
+  size_t dstFileIdx = 0;
+  size_t dstGroupIdx = 0;
+  for (auto &group : groupVec) {
+    if (!hasMultipleInodes(fileVec, group)) {
+      ++removedCount;
+      continue;
+    }
+    size_t beginIdx = dstFileIdx;
+    for (size_t fileIdx = group.beginIdx; fileIdx < group.endIdx; ++fileIdx) {
+      if (fileIdx != dstFileIdx) {
+        fileVec[dstFileIdx] = std::move(fileVec[fileIdx]);
+      }
+      ++dstFileIdx;
+    }
+    groupVec[dstGroupIdx++] = Group(beginIdx, dstFileIdx);
+  }
+  fileVec.erase(std::begin(fileVec) + dstFileIdx, std::end(fileVec));
+  groupVec.erase(std::begin(groupVec) + dstGroupIdx, std::end(groupVec));
+  if (removedCount) {
+    print_quiet("\nFiltered out {:L} single item or empty groups\n", removedCount);
+  }
+}
+
+bool hasMultipleInodes(const FileVec &fileVec, const Group &group)
+{
+  for (size_t fileIdx = group.beginIdx + 1; fileIdx < group.endIdx; ++fileIdx) {
+    if (!fileVec[fileIdx].isSameInode(fileVec[group.beginIdx])) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// Map each file to the first file in the table that is a hard link to the same inode. Files that
+// have no other links in the table map to themselves. This is used for reading each inode only
+// once and copying the hash to the other links.
+std::vector<size_t> getLinkLeaderIdxVec(const FileVec &fileVec)
+{
+  std::vector<size_t> idxVec(fileVec.size());
+  for (size_t fileIdx = 0; fileIdx < fileVec.size(); ++fileIdx) {
+    idxVec[fileIdx] = fileIdx;
+  }
+  std::sort(std::begin(idxVec), std::end(idxVec), [&](size_t a, size_t b) {
+    return std::tie(fileVec[a].dev, fileVec[a].ino, a) < std::tie(fileVec[b].dev, fileVec[b].ino, b);
+  });
+  std::vector<size_t> leaderIdxVec(fileVec.size());
+  for (size_t i = 0; i < idxVec.size(); ++i) {
+    auto fileIdx = idxVec[i];
+    auto isLink = i && fileVec[fileIdx].isSameInode(fileVec[idxVec[i - 1]]);
+    leaderIdxVec[fileIdx] = isLink ? leaderIdxVec[idxVec[i - 1]] : fileIdx;
+  }
+  return leaderIdxVec;
+}
+
+// Split the groups by a hash of the first or last block of each file, then drop the files that end
+// up alone in their group. Most files of the same size already differ in their first few KB, so
+// only the files that survive this need to have their full contents hashed.
+GroupVec filterByPartialHash(FileVec &fileVec, const GroupVec &groupVec, bool isTail)
+{
+  auto keyFn = [](const FileInfo &f) { return std::tie(f.size, f.headHash, f.tailHash); };
+  // Only the first link to each inode is read.
+  auto leaderIdxVec = getLinkLeaderIdxVec(fileVec);
+  std::vector<size_t> linkIdxVec;
+  std::vector<size_t> fileIdxVec;
+  for (const auto &group : groupVec) {
+    if (isPartialHashUseful(fileVec, group, isTail)) {
+      for (size_t fileIdx = group.beginIdx; fileIdx < group.endIdx; ++fileIdx) {
+        (leaderIdxVec[fileIdx] == fileIdx ? fileIdxVec : linkIdxVec).push_back(fileIdx);
+      }
+    }
+  }
+  if (fileIdxVec.empty()) {
+    return groupVec;
+  }
+  print_quiet("\nHashing {} {:L} bytes of {:L} files\n", isTail ? "last" : "first",
+    PARTIAL_HASH_SIZE_ARG, fileIdxVec.size());
+  std::sort(std::begin(fileIdxVec), std::end(fileIdxVec),
+    [&](size_t a, size_t b) { return fileVec[a].path.native() < fileVec[b].path.native(); });
+
+  std::atomic<size_t> nextIdx(0);
+  std::atomic<size_t> readBytes(0);
+  std::vector<char> isFailedVec(fileVec.size(), false);
+  runWorkers([&](size_t) {
+    for (size_t idx; (idx = nextIdx++) < fileIdxVec.size();) {
+      auto &fileInfo = fileVec[fileIdxVec[idx]];
+      try {
+        auto blockHash = calculateBlockHash(fileInfo, isTail, readBytes);
+        (isTail ? fileInfo.tailHash : fileInfo.headHash) = blockHash;
+      }
+      catch (std::exception &e) {
+        {
+          std::lock_guard<std::mutex> lock(STATUS_MUTEX);
+          fmt::print("\nIgnored file: {}\n", fileInfo.path.native());
+          print_verbose("Cause: {}\n", e.what());
+        }
+        isFailedVec[fileIdxVec[idx]] = true;
+      }
+    }
+  });
+  for (auto fileIdx : linkIdxVec) {
+    auto &leaderFileInfo = fileVec[leaderIdxVec[fileIdx]];
+    fileVec[fileIdx].headHash = leaderFileInfo.headHash;
+    fileVec[fileIdx].tailHash = leaderFileInfo.tailHash;
+    isFailedVec[fileIdx] = isFailedVec[leaderIdxVec[fileIdx]];
+  }
+
+  // Drop the files that couldn't be read, then regroup.
+  size_t dstFileIdx = 0;
+  for (size_t fileIdx = 0; fileIdx < fileVec.size(); ++fileIdx) {
+    if (!isFailedVec[fileIdx]) {
+      if (fileIdx != dstFileIdx) {
+        fileVec[dstFileIdx] = std::move(fileVec[fileIdx]);
+      }
+      ++dstFileIdx;
+    }
+  }
+  fileVec.erase(std::begin(fileVec) + dstFileIdx, std::end(fileVec));
+
+  // Files that are no longer in the table will not have their full contents read.
+  size_t eliminatedCount = fileVec.size();
+  size_t eliminatedBytes = 0;
+  for (const auto &fileInfo : fileVec) {
+    eliminatedBytes += fileInfo.size;
+  }
+  auto newGroupVec = groupFiles(fileVec, keyFn);
+  eliminatedCount -= fileVec.size();
+  for (const auto &fileInfo : fileVec) {
+    eliminatedBytes -= fileInfo.size;
+  }
+  print_debug("\n{} block stage:\n", isTail ? "Tail" : "Head");
+  print_debug("{:>14L} files hashed\n", fileIdxVec.size());
+  print_debug("{:>14L} bytes read\n", readBytes.load());
+  print_debug("{:>14L} files eliminated\n", eliminatedCount);
+  print_debug("{:>14L} bytes avoided reading\n", eliminatedBytes);
+  return newGroupVec;
+}
+
+// Hashing a block is only useful if it's smaller than the file, and if none of the files in the
+// group already have a full hash, such as one imported from an md5 list. The tail block is skipped
+// if it would overlap the head, since the full hash then reads at most one more block.
+bool isPartialHashUseful(const FileVec &fileVec, const Group &group, bool isTail)
+{
+  auto size = fileVec[group.beginIdx].size;
+  if (!PARTIAL_HASH_SIZE_ARG || size <= PARTIAL_HASH_SIZE_ARG * (isTail ? 2 : 1)) {
+    return false;
+  }
+  for (size_t fileIdx = group.beginIdx; fileIdx < group.endIdx; ++fileIdx) {
+    if (!fileVec[fileIdx].hash.empty()) {
+      return false;
+    }
+  }
+  return true;
+}
+
+u64 calculateBlockHash(const FileInfo &fileInfo, bool isTail, std::atomic<size_t> &readBytes)
+{
+  auto cacheKey = getCacheKey(fileInfo, isTail ? HashCache::TAIL_FNV64 : HashCache::HEAD_FNV64,
+    static_cast<u32>(PARTIAL_HASH_SIZE_ARG));
+  Hash cachedHash;
+  if (HASH_CACHE.find(cacheKey, cachedHash)) {
+    return cachedHash.toU64();
+  }
+  auto offset = isTail ? fileInfo.size - PARTIAL_HASH_SIZE_ARG : 0;
+  auto blockHash = fnv1A64Block(fileInfo.path, offset, PARTIAL_HASH_SIZE_ARG);
+  readBytes += PARTIAL_HASH_SIZE_ARG;
+  HASH_CACHE.insert(cacheKey, Hash::fromU64(blockHash));
+  return blockHash;
+}
+
+// Files in small groups are read side by side and compared chunk by chunk. Reading stops as soon as
+// all the files are known to differ, and the result can't be fooled by a hash collision. The files
+// that turn out to be unique are dropped and the rest are regrouped by match, so they are skipped
+// by hashAll(). Compared files get no hash, so with a hash cache or checkpoint journal, the groups
+// are hashed instead, and later runs find the hashes instead of reading the files again.
+GroupVec compareSmallGroups(FileVec &fileVec, const GroupVec &groupVec)
+{
+  if (HASH_CACHE.isOpen() || CHECKPOINT_JOURNAL.isOpen()) {
+    return groupVec;
+  }
+  // Only the first link to each inode is read.
+  auto leaderIdxVec = getLinkLeaderIdxVec(fileVec);
+  std::vector<std::vector<size_t>> comparedVec;
+  std::vector<size_t> linkIdxVec;
+  for (const auto &group : groupVec) {
+    if (!isComparisonUseful(fileVec, group, leaderIdxVec)) {
+      continue;
+    }
+    comparedVec.emplace_back();
+    for (size_t fileIdx = group.beginIdx; fileIdx < group.endIdx; ++fileIdx) {
+      (leaderIdxVec[fileIdx] == fileIdx ? comparedVec.back() : linkIdxVec).push_back(fileIdx);
+    }
+  }
+  if (comparedVec.empty()) {
+    return groupVec;
+  }
+  print_quiet("\nComparing {:L} small groups\n", comparedVec.size());
+  std::sort(std::begin(comparedVec), std::end(comparedVec),
+    [&](const std::vector<size_t> &a, const std::vector<size_t> &b) {
+      return fileVec[a.front()].path.native() < fileVec[b.front()].path.native();
+    });
+  // Counted up front, as the indexes in comparedVec are no longer valid once the files that couldn't
+  // be read are dropped.
+  size_t comparedCount = 0;
+  size_t comparedBytes = 0;
+  for (const auto &fileIdxVec : comparedVec) {
+    comparedCount += fileIdxVec.size();
+    comparedBytes += fileIdxVec.size() * fileVec[fileIdxVec.front()].size;
+  }
+
+  std::atomic<size_t> nextIdx(0);
+  std::atomic<u64> nextMatchId(1);
+  std::atomic<size_t> readBytes(0);
+  std::vector<char> isFailedVec(fileVec.size(), false);
+  runWorkers([&](size_t) {
+    for (size_t idx; (idx = nextIdx++) < comparedVec.size();) {
+      compareFiles(fileVec, comparedVec[idx], nextMatchId, readBytes, isFailedVec);
+    }
+  });
+  for (auto fileIdx : linkIdxVec) {
+    fileVec[fileIdx].matchId = fileVec[leaderIdxVec[fileIdx]].matchId;
+    isFailedVec[fileIdx] = isFailedVec[leaderIdxVec[fileIdx]];
+  }
+
+  // Drop the files that couldn't be read, then regroup.
+  size_t dstFileIdx = 0;
+  for (size_t fileIdx = 0; fileIdx < fileVec.size(); ++fileIdx) {
+    if (!isFailedVec[fileIdx]) {
+      if (fileIdx != dstFileIdx) {
+        fileVec[dstFileIdx] = std::move(fileVec[fileIdx]);
+      }
+      ++dstFileIdx;
+    }
+  }
+  fileVec.erase(std::begin(fileVec) + dstFileIdx, std::end(fileVec));
+
+  size_t eliminatedCount = fileVec.size();
+  auto newGroupVec = groupFiles(fileVec, [](const FileInfo &f) {
+    return std::tie(f.size, f.headHash, f.tailHash, f.matchId);
+  });
+  eliminatedCount -= fileVec.size();
+  print_debug("\nCompare stage:\n");
+  print_debug("{:>14L} files compared\n", comparedCount);
+  print_debug("{:>14L} bytes read\n", readBytes.load());
+  print_debug("{:>14L} bytes avoided reading\n", comparedBytes - readBytes.load());
+  print_debug("{:>14L} files eliminated\n", eliminatedCount);
+  return newGroupVec;
+}
+
+// Decide if a group is compared directly. That's the case if it has between two and
+// MAX_COMPARED_GROUP_SIZE distinct inodes, counting hard links once, and none of its files have a
+// hash imported from an md5 list or manifest, as the group is then cheaper to settle by hash.
+bool isComparisonUseful(
+  const FileVec &fileVec, const Group &group, const std::vector<size_t> &leaderIdxVec)
+{
+  size_t inodeCount = 0;
+  for (size_t fileIdx = group.beginIdx; fileIdx < group.endIdx; ++fileIdx) {
+    const auto &fileInfo = fileVec[fileIdx];
+    if (!fileInfo.hash.empty()) {
+      return false;
+    }
+    inodeCount += leaderIdxVec[fileIdx] == fileIdx;
+  }
+  return inodeCount >= 2 && inodeCount <= MAX_COMPARED_GROUP_SIZE;
+}
+
+// Read the files in lockstep and split them into sets of files with the same contents. After each
+// chunk, each file joins the set of the first earlier file in its old set that had the same chunk.
+// Files that are alone in their set are not read any further. A file that can't be read is dropped
+// and the comparison continues with the others.
+void compareFiles(FileVec &fileVec, const std::vector<size_t> &fileIdxVec,
+  std::atomic<u64> &nextMatchId, std::atomic<size_t> &readBytes, std::vector<char> &isFailedVec)
+{
+  auto fileCount = fileIdxVec.size();
+  auto size = fileVec[fileIdxVec.front()].size;
+  std::vector<std::unique_ptr<FileReader>> readerVec(fileCount);
+  std::vector<std::unique_ptr<u8[]>> bufVec(fileCount);
+  std::vector<size_t> setVec(fileCount, 0);
+  std::vector<char> isFailedInGroupVec(fileCount, false);
+  auto fail = [&](size_t i, const std::exception &e) {
+    {
+      std::lock_guard<std::mutex> lock(STATUS_MUTEX);
+      fmt::print("\nIgnored file: {}\n", fileVec[fileIdxVec[i]].path.native());
+      print_verbose("Cause: {}\n", e.what());
+    }
+    isFailedInGroupVec[i] = true;
+    isFailedVec[fileIdxVec[i]] = true;
+  };
+  for (size_t i = 0; i < fileCount; ++i) {
+    try {
+      readerVec[i] = std::make_unique<FileReader>(fileVec[fileIdxVec[i]].path);
+      bufVec[i].reset(new u8[FileReader::CHUNK_SIZE]);
+    }
+    catch (std::exception &e) {
+      fail(i, e);
+    }
+  }
+  auto isShared = [&](size_t i) {
+    for (size_t j = 0; j < fileCount; ++j) {
+      if (j != i && !isFailedInGroupVec[j] && setVec[j] == setVec[i]) {
+        return true;
+      }
+    }
+    return false;
+  };
+  for (u64 offset = 0; offset < size; offset += FileReader::CHUNK_SIZE) {
+    auto len = static_cast<size_t>(std::min<u64>(FileReader::CHUNK_SIZE, size - offset));
+    std::vector<char> isReadVec(fileCount, false);
+    for (size_t i = 0; i < fileCount; ++i) {
+      if (isFailedInGroupVec[i] || !isShared(i)) {
+        continue;
+      }
+      try {
+        readerVec[i]->readBlock(offset, bufVec[i].get(), len);
+        readBytes += len;
+        isReadVec[i] = true;
+      }
+      catch (std::exception &e) {
+        fail(i, e);
+      }
+    }
+    if (std::find(std::begin(isReadVec), std::end(isReadVec), true) == std::end(isReadVec)) {
+      break;
+    }
+    auto newSetVec = setVec;
+    for (size_t i = 0; i < fileCount; ++i) {
+      if (!isReadVec[i]) {
+        continue;
+      }
+      newSetVec[i] = i;
+      for (size_t j = 0; j < i; ++j) {
+        if (isReadVec[j] && setVec[j] == setVec[i] && newSetVec[j] == j &&
+          !memcmp(bufVec[j].get(), bufVec[i].get(), len)) {
+          newSetVec[i] = j;
+          break;
+        }
+      }
+    }
+    setVec = newSetVec;
+  }
+  // Match ids only have to be unique among files of the same size, but a shared counter is simpler.
+  auto baseMatchId = nextMatchId.fetch_add(fileCount);
+  for (size_t i = 0; i < fileCount; ++i) {
+    fileVec[fileIdxVec[i]].matchId = baseMatchId + setVec[i];
+  }
+}
+
+void openHashCache()
+{
+  if (HASH_CACHE_PATH_ARG.empty()) {
+    return;
+  }
+  try {
+    HASH_CACHE.open(HASH_CACHE_PATH_ARG);
+  }
+  catch (const std::exception &e) {
+    fmt::print("Error: {}\n", e.what());
+    exit(1);
+  }
+}
+
+// Store the new hashes as soon as hashing is done, so they're kept even if the interactive session
+// is interrupted.
+void closeHashCache()
+{
+  if (!HASH_CACHE.isOpen()) {
+    return;
+  }
+  print_debug("\nHash cache:\n");
+  print_debug("{:>14L} hits\n", HASH_CACHE.getHitCount());
+  print_debug("{:>14L} misses\n", HASH_CACHE.getMissCount());
+  try {
+    HASH_CACHE.close(COMPACT_CACHE_ARG);
+  }
+  catch (const std::exception &e) {
+    fmt::print("\nError: {}\n", e.what());
+  }
+}
+
+HashCache::Key getCacheKey(const FileInfo &fileInfo, HashCache::Algo algo, u32 param)
+{
+  return HashCache::Key(fileInfo.dev, fileInfo.ino, fileInfo.size, fileInfo.mtime, algo, param);
+}
+
+// Cached hashes are stored per algorithm, so hashes from runs with different algorithms are never
+// mixed up.
+HashCache::Algo getCacheAlgo()
+{
+  switch (HASH_ALGO) {
+  case HashAlgo::FNV64:
+    return HashCache::FNV64;
+  case HashAlgo::MD5:
+    return HashCache::MD5;
+  default:
+    return HashCache::WIDE128;
+  }
+}
+
+// With --resume, the journal of an interrupted run is loaded and appended to. Otherwise, a new
+// journal is started.
+void openCheckpointJournal()
+{
+  if (CHECKPOINT_PATH_ARG.empty()) {
+    return;
+  }
+  try {
+    CHECKPOINT_JOURNAL.open(
+      CHECKPOINT_PATH_ARG, getHashAlgoName(HASH_ALGO), getTreeSegmentSize(), RESUME_ARG);
+  }
+  catch (const std::exception &e) {
+    fmt::print("Error: {}\n", e.what());
+    exit(1);
+  }
+}
+
+// The journal is kept after a complete run, so that an interrupted interactive session can be
+// resumed without hashing again.
+void closeCheckpointJournal()
+{
+  try {
+    CHECKPOINT_JOURNAL.close();
+  }
+  catch (const std::exception &e) {
+    fmt::print("\nError: {}\n", e.what());
+  }
+}
+
+// Take the hashes of the files that were hashed before the run was interrupted from the journal.
+// Files that have changed since then are hashed again. The hashes are taken before the partial
+// hashes, so groups with hashed files skip the partial hashing as well.
+void resumeFromCheckpoint(FileVec &fileVec)
+{
+  if (!RESUME_ARG) {
+    return;
+  }
+  size_t resumedCount = 0;
+  for (auto &fileInfo : fileVec) {
+    if (fileInfo.hash.empty() && CHECKPOINT_JOURNAL.find(fileInfo.path.native(), fileInfo.size,
+                                   fileInfo.mtime, fileInfo.hash)) {
+      print_verbose("Resumed: {}\n", fileInfo.str());
+      ++resumedCount;
+    }
+  }
+  print_quiet("\nResumed {:L} hashes of {:L} in checkpoint journal\n", resumedCount,
+    CHECKPOINT_JOURNAL.getLoadedCount());
+}
+
+// Calculate hashes for all files. The worker threads pull files by index from a shared counter and
+// each hash is written only to its own FileInfo, so the result doesn't depend on the thread count.
+// The table is ordered by size at this point, so the files are hashed in path order instead, or in
+// the order they are stored in on rotational disks, to avoid skipping around on the disk. Hard
+// links to the same inode are hashed only once.
+void hashAll(FileVec &fileVec)
+{
+  auto leaderIdxVec = getLinkLeaderIdxVec(fileVec);
+  auto fileIdxVec = getIdxVecSortedByPath(fileVec);
+  size_t linkCount = 0;
+  fileIdxVec.erase(std::remove_if(std::begin(fileIdxVec), std::end(fileIdxVec),
+                     [&](size_t fileIdx) {
+                       linkCount += leaderIdxVec[fileIdx] != fileIdx;
+                       return leaderIdxVec[fileIdx] != fileIdx || fileVec[fileIdx].matchId;
+                     }),
+    std::end(fileIdxVec));
+  orderByDiskLayout(fileVec, fileIdxVec);
+  hashFiles(fileVec, fileIdxVec, nullptr);
+  for (size_t fileIdx = 0; fileIdx < fileVec.size(); ++fileIdx) {
+    if (leaderIdxVec[fileIdx] != fileIdx) {
+      fileVec[fileIdx].hash = fileVec[leaderIdxVec[fileIdx]].hash;
+      fileVec[fileIdx].segmentHashVec = fileVec[leaderIdxVec[fileIdx]].segmentHashVec;
+    }
+  }
+  print_debug("{:>14L} hard links were not read\n", linkCount);
+}
+
+// Hash the files, which are taken in the given order on each device. Only the listed files are
+// read or changed. If onFileDone is given, it's called with the index of each file once the
+// hashing threads are done with it, and no status is displayed, as the caller displays its own.
+void hashFiles(FileVec &fileVec, const std::vector<size_t> &fileIdxVec,
+  const std::function<void(size_t fileIdx, bool isUnhashed)> &onFileDone)
+{
+  auto totalSizeOfUnhashed = getTotalSizeOfUnhashed(fileVec, fileIdxVec);
+  auto deviceQueueVec = getDeviceQueueVec(fileVec, fileIdxVec);
+  // Filled in before the workers start, which then only look devices up with at().
+  std::map<u64, DeviceQueue *> deviceQueueMap;
+  for (auto &deviceQueue : deviceQueueVec) {
+    deviceQueueMap[deviceQueue.dev] = &deviceQueue;
+  }
+  std::atomic<size_t> accumulatedSize(0);
+  std::atomic<size_t> processedCount(0);
+  auto onHashed = [&](FileInfo &fileInfo, bool isUnhashed) {
+    // Snapshot the counters so that only the thread that completes the last file sees the totals.
+    size_t accumulated = isUnhashed ? accumulatedSize += fileInfo.size : accumulatedSize.load();
+    size_t processed = ++processedCount;
+    if (isUnhashed) {
+      deviceQueueMap.at(fileInfo.dev)->hashedBytes += fileInfo.size;
+    }
+    if (isUnhashed && !fileInfo.hash.empty()) {
+      try {
+        CHECKPOINT_JOURNAL.append(
+          fileInfo.path.native(), fileInfo.size, fileInfo.mtime, fileInfo.hash);
+      }
+      catch (std::exception &e) {
+        std::lock_guard<std::mutex> lock(STATUS_MUTEX);
+        fmt::print("\nError: {}\nHashing continues without checkpoints\n", e.what());
+      }
+    }
+    if (onFileDone) {
+      onFileDone(static_cast<size_t>(&fileInfo - fileVec.data()), isUnhashed);
+      return;
+    }
+    std::lock_guard<std::mutex> lock(STATUS_MUTEX);
+    displayHashStatus(fileInfo, accumulated, totalSizeOfUnhashed, fileIdxVec.size(), processed,
+      deviceQueueVec);
+  };
+  // Large files are hashed first, by all the workers of their device together.
+  std::vector<std::unique_ptr<TreeQueue>> treeQueueVec;
+  for (auto &deviceQueue : deviceQueueVec) {
+    std::vector<size_t> treeIdxVec;
+    auto &queueIdxVec = deviceQueue.fileIdxVec;
+    queueIdxVec.erase(std::remove_if(std::begin(queueIdxVec), std::end(queueIdxVec),
+                        [&](size_t fileIdx) {
+                          auto isTree = isTreeHashed(fileVec[fileIdx]);
+                          if (isTree) {
+                            treeIdxVec.push_back(fileIdx);
+                          }
+                          return isTree;
+                        }),
+      std::end(queueIdxVec));
+    treeQueueVec.push_back(std::make_unique<TreeQueue>(fileVec, treeIdxVec, onHashed));
+  }
+  auto isMultiBuffer = HASH_ALGO == HashAlgo::MD5 && Md5MultiBuffer::getLaneCount() > 1;
+  // Each worker reads from a single device.
+  std::vector<DeviceQueue *> workerQueueVec;
+  for (auto &deviceQueue : deviceQueueVec) {
+    workerQueueVec.insert(std::end(workerQueueVec), deviceQueue.threadCount, &deviceQueue);
+  }
+  // Workers that can't set up io_uring fall back to the readers below.
+  std::atomic<size_t> uringWorkerCount(0);
+  runWorkers(
+    [&](size_t workerIdx) {
+      treeQueueVec[workerQueueVec[workerIdx] - deviceQueueVec.data()]->hashSegments();
+      auto &queueIdxVec = workerQueueVec[workerIdx]->fileIdxVec;
+      auto &nextIdx = workerQueueVec[workerIdx]->nextIdx;
+      if (IO_URING_ARG && hashUring(fileVec, queueIdxVec, nextIdx, onHashed)) {
+        ++uringWorkerCount;
+        return;
+      }
+      if (isMultiBuffer) {
+        hashMultiBuffer(fileVec, queueIdxVec, nextIdx, onHashed);
+        return;
+      }
+      for (size_t idx; !IS_HASHING_STOPPED && (idx = nextIdx++) < queueIdxVec.size();) {
+        auto &fileInfo = fileVec[queueIdxVec[idx]];
+        auto isUnhashed = fileInfo.hash.empty();
+        try {
+          calculateHash(fileInfo);
+        }
+        catch (std::exception &e) {
+          std::lock_guard<std::mutex> lock(STATUS_MUTEX);
+          fmt::print("\nIgnored file: {}\n", fileInfo.path.native());
+          print_verbose("Cause: {}\n", e.what());
+        }
+        onHashed(fileInfo, isUnhashed);
+      }
+    },
+    workerQueueVec.size());
+  print_debug("\n");
+  size_t treeCount = 0;
+  size_t segmentCount = 0;
+  for (const auto &treeQueue : treeQueueVec) {
+    treeCount += treeQueue->getHashedCount();
+    segmentCount += treeQueue->getSegmentCount();
+  }
+  if (treeCount) {
+    print_debug("{:>14L} large files hashed in {:L} segments\n", treeCount, segmentCount);
+  }
+  if (HASH_ALGO == HashAlgo::WIDE128) {
+    print_debug("{:>14} kernel for wide128 hashes\n", Wide128::getKernelName());
+  }
+  for (auto &deviceQueue : deviceQueueVec) {
+    print_debug("{:>14L} files on {} ({}, threads: {})\n", deviceQueue.fileIdxVec.size(),
+      deviceQueue.name, deviceQueue.isRotational ? "rotational" : "non-rotational",
+      deviceQueue.threadCount);
+  }
+  if (isMultiBuffer && uringWorkerCount < workerQueueVec.size()) {
+    print_debug("{:>14} kernel for md5 hashes, {} files at a time per thread\n",
+      Md5MultiBuffer::getKernelName(), Md5MultiBuffer::getLaneCount());
+  }
+  if (IO_URING_ARG) {
+    print_debug("{:>14L} of {} threads read with io_uring, {} reads in flight per thread\n",
+      uringWorkerCount.load(), workerQueueVec.size(), UringReader::getQueueDepth());
+  }
+}
+
+TreeQueue::TreeQueue(FileVec &fileVec, const std::vector<size_t> &fileIdxVec,
+  std::function<void(FileInfo &, bool)> onHashed)
+  : fileVec(fileVec), onHashed(std::move(onHashed)), treeVec(fileIdxVec.size())
+{
+  auto segmentSize = getTreeSegmentSize();
+  for (size_t treeIdx = 0; treeIdx < fileIdxVec.size(); ++treeIdx) {
+    auto &fileInfo = fileVec[fileIdxVec[treeIdx]];
+    auto isUnhashed = fileInfo.hash.empty();
+    if (!isUnhashed || findCachedHash(fileInfo)) {
+      this->onHashed(fileInfo, isUnhashed);
+      continue;
+    }
+    auto &tree = treeVec[treeIdx];
+    auto segmentCount = (fileInfo.size + segmentSize - 1) / segmentSize;
+    tree.fileIdx = fileIdxVec[treeIdx];
+    tree.segmentHashVec.resize(segmentCount);
+    tree.remainingCount = segmentCount;
+    ++hashedCount;
+    for (size_t segmentIdx = 0; segmentIdx < segmentCount; ++segmentIdx) {
+      segmentVec.emplace_back(treeIdx, segmentIdx);
+    }
+  }
+}
+
+void TreeQueue::hashSegments()
+{
+  auto segmentSize = getTreeSegmentSize();
+  for (size_t idx; !IS_HASHING_STOPPED && (idx = nextIdx++) < segmentVec.size();) {
+    auto &tree = treeVec[segmentVec[idx].first];
+    auto segmentIdx = segmentVec[idx].second;
+    auto &fileInfo = fileVec[tree.fileIdx];
+    if (!tree.isFailed) {
+      try {
+        auto offset = segmentIdx * segmentSize;
+        tree.segmentHashVec[segmentIdx] = hashFileRange(
+          fileInfo.path, HASH_ALGO, offset, std::min(segmentSize, fileInfo.size - offset));
+      }
+      catch (std::exception &e) {
+        if (!tree.isFailed.exchange(true)) {
+          std::lock_guard<std::mutex> lock(STATUS_MUTEX);
+          fmt::print("\nIgnored file: {}\n", fileInfo.path.native());
+          print_verbose("Cause: {}\n", e.what());
+        }
+      }
+    }
+    if (--tree.remainingCount) {
+      continue;
+    }
+    // The thread that hashed the last segment finishes the tree.
+    if (!tree.isFailed) {
+      fileInfo.segmentHashVec = std::move(tree.segmentHashVec);
+      storeHash(fileInfo, hashTreeRoot(fileInfo.segmentHashVec, HASH_ALGO));
+    }
+    onHashed(fileInfo, true);
+  }
+}
+
+size_t TreeQueue::getHashedCount() const
+{
+  return hashedCount;
+}
+
+size_t TreeQueue::getSegmentCount() const
+{
+  return segmentVec.size();
+}
+
+bool isTreeHashed(const FileInfo &fileInfo)
+{
+  return TREE_SEGMENT_SIZE_ARG && fileInfo.size > getTreeSegmentSize();
+}
+
+u64 getTreeSegmentSize()
+{
+  return static_cast<u64>(TREE_SEGMENT_SIZE_ARG) * 1024 * 1024;
+}
+
+// Sort the files on rotational devices, or on all devices with --disk-order always, by the
+// location of their first extent on the device, so that the disk head sweeps across the disk
+// instead of seeking back and forth. Files on other devices stay in path order. Files that don't
+// need to be read, and files with an unknown location, go first, since they cost no seeking.
+void orderByDiskLayout(const FileVec &fileVec, std::vector<size_t> &fileIdxVec)
+{
+  if (DISK_ORDER_ARG == "never") {
+    return;
+  }
+  std::map<u64, bool> isOrderedDevMap;
+  for (auto fileIdx : fileIdxVec) {
+    auto dev = fileVec[fileIdx].dev;
+    if (dev && !isOrderedDevMap.count(dev)) {
+      isOrderedDevMap[dev] = DISK_ORDER_ARG == "always" || isRotationalDevice(dev);
+    }
+  }
+  std::vector<size_t> orderedIdxVec;
+  for (auto fileIdx : fileIdxVec) {
+    auto dev = fileVec[fileIdx].dev;
+    if (dev && isOrderedDevMap[dev]) {
+      orderedIdxVec.push_back(fileIdx);
+    }
+  }
+  if (orderedIdxVec.empty()) {
+    return;
+  }
+  std::vector<u64> offsetVec(fileVec.size(), 0);
+  std::atomic<size_t> nextIdx(0);
+  std::atomic<size_t> unknownCount(0);
+  runWorkers([&](size_t) {
+    for (size_t idx; (idx = nextIdx++) < orderedIdxVec.size();) {
+      const auto &fileInfo = fileVec[orderedIdxVec[idx]];
+      if (!fileInfo.hash.empty() || HASH_CACHE.contains(getHashCacheKey(fileInfo))) {
+        continue;
+      }
+      auto offset = getPhysicalOffset(fileInfo.path);
+      if (offset == UNKNOWN_PHYSICAL_OFFSET) {
+        ++unknownCount;
+        continue;
+      }
+      offsetVec[orderedIdxVec[idx]] = offset;
+    }
+  });
+  std::stable_sort(std::begin(fileIdxVec), std::end(fileIdxVec), [&](size_t a, size_t b) {
+    return std::make_pair(fileVec[a].dev, offsetVec[a]) <
+      std::make_pair(fileVec[b].dev, offsetVec[b]);
+  });
+  print_debug("\nDisk order:\n");
+  print_debug("{:>14L} of {} devices ordered by physical location\n",
+    std::count_if(std::begin(isOrderedDevMap), std::end(isOrderedDevMap),
+      [](const std::pair<const u64, bool> &pair) { return pair.second; }),
+    isOrderedDevMap.size());
+  print_debug("{:>14L} files ordered\n", orderedIdxVec.size() - unknownCount);
+  print_debug("{:>14L} files with unknown location\n", unknownCount.load());
+}
+
+// Split the files into a queue for each device, keeping their order. The totals only count the
+// files that still need to be read.
+DeviceQueueVec getDeviceQueueVec(const FileVec &fileVec, const std::vector<size_t> &fileIdxVec)
+{
+  std::map<u64, std::vector<size_t>> devFileIdxVecMap;
+  for (auto fileIdx : fileIdxVec) {
+    devFileIdxVecMap[fileVec[fileIdx].dev].push_back(fileIdx);
+  }
+  DeviceQueueVec deviceQueueVec(devFileIdxVecMap.size());
+  auto startTime = std::chrono::steady_clock::now();
+  size_t queueIdx = 0;
+  for (auto &pair : devFileIdxVecMap) {
+    auto &deviceQueue = deviceQueueVec[queueIdx++];
+    deviceQueue.dev = pair.first;
+    // Files imported from md5 lists have no device.
+    deviceQueue.name = pair.first ? getDeviceName(pair.first) : "unknown device";
+    deviceQueue.isRotational = pair.first && isRotationalDevice(pair.first);
+    deviceQueue.threadCount = getDeviceThreadCount(pair.first, deviceQueue.isRotational);
+    deviceQueue.fileIdxVec = std::move(pair.second);
+    deviceQueue.totalBytes = getTotalSizeOfUnhashed(fileVec, deviceQueue.fileIdxVec);
+    deviceQueue.startTime = startTime;
+  }
+  return deviceQueueVec;
+}
+
+// A rotational disk serves one read at a time, so more threads would only make it seek between
+// them. Other devices get the full thread count. --device-threads overrides both.
+size_t getDeviceThreadCount(u64 dev, bool isRotational)
+{
+  auto iter = DEVICE_THREAD_COUNT_MAP.find(dev);
+  if (iter != DEVICE_THREAD_COUNT_MAP.end()) {
+    return iter->second;
+  }
+  return isRotational ? 1 : getThreadCount();
+}
+
+// Bytes read in all stages, by the policy they were read with. Files on file systems without
+// O_DIRECT support show up as cached when the direct policy is selected.
+void displayReadStats()
+{
+  print_debug("\nFile reads:\n");
+  for (auto policy : {IoPolicy::CACHED, IoPolicy::SEQUENTIAL, IoPolicy::DIRECT}) {
+    auto readBytes = FileReader::getReadBytes(policy);
+    if (readBytes) {
+      print_debug("{:>14L} bytes read with the {} policy\n", readBytes, getIoPolicyName(policy));
+    }
+  }
+  if (READAHEAD_ARG) {
+    print_debug("{:>14L} KiB readahead window\n", READAHEAD_ARG);
+  }
+}
+
+// Hash the files with MD5 in the SIMD lanes of one worker thread. Files that already have a hash,
+// or have one in the cache, are passed over without taking up a lane.
+void hashMultiBuffer(FileVec &fileVec, const std::vector<size_t> &fileIdxVec,
+  std::atomic<size_t> &nextIdx, const std::function<void(FileInfo &, bool)> &onHashed)
+{
+  Md5MultiBuffer::run(
+    [&](Md5MultiBuffer::Job &job) {
+      for (size_t idx; !IS_HASHING_STOPPED && (idx = nextIdx++) < fileIdxVec.size();) {
+        auto &fileInfo = fileVec[fileIdxVec[idx]];
+        auto isUnhashed = fileInfo.hash.empty();
+        if (!isUnhashed || findCachedHash(fileInfo)) {
+          onHashed(fileInfo, isUnhashed);
+          continue;
+        }
+        job.id = fileIdxVec[idx];
+        job.path = fileInfo.path;
+        job.size = fileInfo.size;
+        return true;
+      }
+      return false;
+    },
+    [&](size_t fileIdx, const Hash &hash) {
+      storeHash(fileVec[fileIdx], hash);
+      onHashed(fileVec[fileIdx], true);
+    },
+    [&](size_t fileIdx, const std::exception &e) {
+      {
+        std::lock_guard<std::mutex> lock(STATUS_MUTEX);
+        fmt::print("\nIgnored file: {}\n", fileVec[fileIdx].path.native());
+        print_verbose("Cause: {}\n", e.what());
+      }
+      onHashed(fileVec[fileIdx], true);
+    });
+}
+
+// Hash the files with reads through io_uring. Returns false if io_uring is not available, in which
+// case no files have been taken.
+bool hashUring(FileVec &fileVec, const std::vector<size_t> &fileIdxVec,
+  std::atomic<size_t> &nextIdx, const std::function<void(FileInfo &, bool)> &onHashed)
+{
+  return UringReader::run(
+    HASH_ALGO,
+    [&](UringReader::Job &job) {
+      for (size_t idx; !IS_HASHING_STOPPED && (idx = nextIdx++) < fileIdxVec.size();) {
+        auto &fileInfo = fileVec[fileIdxVec[idx]];
+        auto isUnhashed = fileInfo.hash.empty();
+        if (!isUnhashed || findCachedHash(fileInfo)) {
+          onHashed(fileInfo, isUnhashed);
+          continue;
+        }
+        job.id = fileIdxVec[idx];
+        job.path = fileInfo.path;
+        job.size = fileInfo.size;
+        return true;
+      }
+      return false;
+    },
+    [&](size_t fileIdx, const Hash &hash) {
+      storeHash(fileVec[fileIdx], hash);
+      onHashed(fileVec[fileIdx], true);
+    },
+    [&](size_t fileIdx, const std::exception &e) {
+      {
+        std::lock_guard<std::mutex> lock(STATUS_MUTEX);
+        fmt::print("\nIgnored file: {}\n", fileVec[fileIdx].path.native());
+        print_verbose("Cause: {}\n", e.what());
+      }
+      onHashed(fileVec[fileIdx], true);
+    });
+}
+
+void calculateHash(FileInfo &fileInfo)
+{
+  if (!fileInfo.hash.empty() || findCachedHash(fileInfo)) {
+    return;
+  }
+  storeHash(fileInfo, hashFile(fileInfo.path, HASH_ALGO));
+}
+
+bool findCachedHash(FileInfo &fileInfo)
 {
-  if (!is_directory(p)) {
-    fmt::print("Invalid path: {}\n", p.native());
+  if (HASH_CACHE.find(getHashCacheKey(fileInfo), fileInfo.hash)) {
+    print_verbose("Cached: {}\n", fileInfo.str());
     return true;
   }
   return false;
 }
 
-// Create vector of files to check for duplicates.
-FileVec findAllFiles()
+void storeHash(FileInfo &fileInfo, const Hash &hash)
 {
-  FileVec fileVec;
-  // Add all files in search folders, non-recursive.
-  for (auto &p : PATH_VEC_ARG) {
-    print_verbose("\nProcessing non-recursive: {}\n", p.native());
-    addPath(fileVec, canonical(p), false);
-  }
-  // Add all files in search folders, recursive.
-  for (auto &p : RECURSIVE_PATH_VEC_ARG) {
-    print_verbose("\nProcessing recursive: {}\n", p.native());
-    addPath(fileVec, canonical(p), true);
-  }
-  // Add all files provided as md5 vectors.
-  for (auto &p : MD5_PATH_VEC_ARG) {
-    print_verbose("\nProcessing MD5 file: {}\n", p.native());
-    addMd5File(fileVec, p);
-  }
-  displayFindStatus(fileVec, true);
-  return fileVec;
+  fileInfo.hash = hash;
+  HASH_CACHE.insert(getHashCacheKey(fileInfo), fileInfo.hash);
+  print_verbose("{}: {}\n", getHashAlgoName(HASH_ALGO), fileInfo.str());
 }
 
-// Add a file or directory path.
-void addPath(FileVec &fileVec, const fs::path &path, const bool &recursive)
+// Tree hashes depend on the segment size, so it's part of the key.
+HashCache::Key getHashCacheKey(const FileInfo &fileInfo)
 {
-  try {
-    // Do not follow symlinks and junctions.
-    if ((!is_regular_file(path) && !is_directory(path)) || isJunction(path)) {
-      print_verbose("Ignored special file: {}\n", path.native());
-      return;
-    }
-    if (is_regular_file(path)) {
-      addFile(fileVec, path);
-    }
-    else {
-      print_verbose("Entering dir: {}\n", path.native());
-      for (const auto &subPath : fs::directory_iterator(path)) {
-        addPath(fileVec, subPath, recursive);
+  return getCacheKey(fileInfo, getCacheAlgo(),
+    isTreeHashed(fileInfo) ? static_cast<u32>(TREE_SEGMENT_SIZE_ARG) : 0);
+}
+
+void displayHashStatus(const FileInfo &fileInfo, size_t accumulatedSize, size_t totalSize,
+  size_t fileCount, size_t fileIdx, const DeviceQueueVec &deviceQueueVec)
+{
+  if (!QUIET_ARG && totalSize &&
+    (LAST_STATUS_TIME.elapsed() >= 1.0 || accumulatedSize == totalSize)) {
+    print_quiet("\nCalculating {} hashes:\n", getHashAlgoName(HASH_ALGO));
+    print_quiet("Data: {:.2f}% ({:L} / {:L} bytes)\n",
+      (float)accumulatedSize / (float)totalSize * 100, accumulatedSize, totalSize);
+    print_quiet("Files: {:.2f}% ({:L} / {:L} files)\n", (float)fileIdx / (float)fileCount * 100,
+      fileIdx, fileCount);
+    for (auto &deviceQueue : deviceQueueVec) {
+      if (!deviceQueue.totalBytes) {
+        continue;
       }
+      std::chrono::duration<double> elapsed =
+        std::chrono::steady_clock::now() - deviceQueue.startTime;
+      print_quiet("Device {}: {:.2f}% ({:L} / {:L} bytes) at {:.1f} MB/s, threads: {}\n",
+        deviceQueue.name, (float)deviceQueue.hashedBytes / (float)deviceQueue.totalBytes * 100,
+        deviceQueue.hashedBytes.load(), deviceQueue.totalBytes,
+        deviceQueue.hashedBytes / std::max(elapsed.count(), 0.001) / 1e6, deviceQueue.threadCount);
     }
-  }
-  catch (const std::exception &e) {
-    fmt::print("\nIgnored file: {}\n", path.native());
-    print_verbose("Cause: {}\n", e.what());
+    LAST_STATUS_TIME.restart();
+    print_quiet("\n");
   }
 }
 
-// Add a vector of files generated with md5deep or similar. File format is one size, MD5 and full
-// path per line. Example: 43912  ccd6dad4b72d1255cf2e7a9dadd64083  C:\Documents and
-// Settings\Administrator\Desktop\test.txt
-void addMd5File(FileVec &fileVec, const fs::path &md5DeepPath)
+// Sum up the total size of files to hash. The vector may include entries imported from md5 files,
+// which includes hash.
+size_t getTotalSizeOfUnhashed(const FileVec &fileVec, const std::vector<size_t> &fileIdxVec)
 {
-  regex md5Line(" *([0-9]+) +([0-9a-fA-F]{32}) +(.*)");
-  boost::smatch what;
-  size_t fileCount(0);
-  // Open file for reading.
-  std::wifstream fi(md5DeepPath.native().c_str());
-  if (!fi.good()) {
-    fmt::print("\nError: Couldn't open file: {}\n", md5DeepPath);
-    return;
-  }
-
-  while (fi.good()) {
-    fileCount++;
-    std::string line;
-    // getline(fi, line); TODO
-    trim(line);
-    if (line.empty()) {
-      continue;
-    }
-    // Parse line into size, md5 and path.
-    if (!regex_search(line, what, md5Line)) {
-      fmt::print("\nError: Malformed line in md5 file: {}\n", md5DeepPath);
-      fmt::print("Line: {}\n", line);
-      continue;
+  size_t totalSize(0);
+  for (auto fileIdx : fileIdxVec) {
+    if (fileVec[fileIdx].hash.empty()) {
+      totalSize += fileVec[fileIdx].size;
     }
-    std::string sizeStr(what[1].first, what[1].second);
-    std::string md5(what[2].first, what[2].second);
-    std::string filePath(what[3].first, what[3].second);
-    addFile(fileVec, filePath);
   }
+  return totalSize;
 }
 
-void addFile(FileVec &fileVec, const fs::path &filePath)
+std::vector<size_t> getIdxVecSortedByPath(const FileVec &fileVec)
 {
-  auto absFilePath = canonical(filePath);
-  auto fileSize = filesystem::file_size(absFilePath);
-  // Filter small files if requested.
-  if (IGNORE_SMALLER_ARG != (size_t)-1 && fileSize <= IGNORE_SMALLER_ARG) {
-    print_verbose(
-      "Ignored small file (< {:n}): {:n} {}\n", IGNORE_SMALLER_ARG, fileSize, absFilePath.native());
-    return;
-  }
-  // Filter large files if requested.
-  if (IGNORE_LARGER_ARG != (size_t)-1 && fileSize >= IGNORE_LARGER_ARG) {
-    print_verbose("Ignored large file (> {:n}): {:n} {}\n", IGNORE_LARGER_ARG, fileSize,
-      absFilePath.native(), absFilePath.native());
-    return;
+  std::vector<size_t> fileIdxVec(fileVec.size());
+  for (size_t fileIdx = 0; fileIdx < fileVec.size(); ++fileIdx) {
+    fileIdxVec[fileIdx] = fileIdx;
   }
-  // Add file.
-  auto fileInfo = FileInfo(absFilePath, fileSize, "");
-  fileVec.push_back(fileInfo);
-  print_verbose("Found: {}\n", fileInfo.str());
-  displayFindStatus(fileVec);
+  std::sort(std::begin(fileIdxVec), std::end(fileIdxVec),
+    [&](size_t a, size_t b) { return fileVec[a].path.native() < fileVec[b].path.native(); });
+  return fileIdxVec;
 }
 
-// Display status if more than one second has elapsed.
-void displayFindStatus(const FileVec &fileVec, bool forceDisplay)
+size_t getThreadCount()
 {
-  if (forceDisplay || (!QUIET_ARG && LAST_STATUS_TIME.elapsed() >= 1.0)) {
-    print_quiet("\nFiles found: {:n}\n", fileVec.size());
-    LAST_STATUS_TIME.restart();
+  if (THREAD_COUNT_ARG) {
+    return THREAD_COUNT_ARG;
   }
-  fmt::print("\n");
+  return std::max(std::thread::hardware_concurrency(), 1U);
 }
 
-SizeToGroupMap groupFilesBySize(const FileVec &fileVec)
+// Files that could not be hashed have already been reported by hashAll() and are dropped here.
+// Files that were compared directly have a match id instead of a hash.
+GroupVec groupFilesByHash(FileVec &fileVec)
 {
-  SizeToGroupMap sizeToGroupMap;
-  for (auto &fileInfo : fileVec) {
-    sizeToGroupMap[fileInfo.size].push_back(fileInfo);
-  }
-  return sizeToGroupMap;
+  fileVec.erase(std::remove_if(std::begin(fileVec), std::end(fileVec),
+                  [](const FileInfo &f) { return f.hash.empty() && !f.matchId; }),
+    std::end(fileVec));
+  auto groupVec = groupFiles(
+    fileVec, [](const FileInfo &f) { return std::tie(f.size, f.hash, f.matchId); });
+  sortAllFileInfoVec(fileVec, groupVec);
+  sortGroupsBySize(fileVec, groupVec);
+  return groupVec;
 }
 
-// Remove groups with only one item. These file in the group has unique file size or hash so cannot
-// have duplicates.
-template <typename GroupMap> void removeSingleItemGroups(GroupMap &groupMap)
+// Split a candidate group whose files have all been hashed into groups by hash, as
+// groupFilesByHash() does for the whole table. The file table can't be compacted while hashing
+// runs, so the files are only reordered within the range of the candidate group. Files that
+// couldn't be hashed are moved to the end of the range, and they and the files that are left
+// without duplicates are kept out of the groups. Hard links that were not read get the hash of a
+// link that was, which is in the same candidate group, as it has the same contents.
+GroupVec groupHashedFiles(FileVec &fileVec, const Group &candidateGroup)
 {
-  size_t removedCount = 0;
-  auto iter = groupMap.begin();
-  while (iter != groupMap.end()) {
-    if (iter->second.size() <= 1) {
-      iter = groupMap.erase(iter);
-      ++removedCount;
+  auto beginIter = std::begin(fileVec) + candidateGroup.beginIdx;
+  auto endIter = std::begin(fileVec) + candidateGroup.endIdx;
+  for (auto iter = beginIter; iter != endIter; ++iter) {
+    if (!iter->hash.empty() || iter->matchId) {
+      continue;
     }
-    else {
-      ++iter;
+    auto leaderIter = std::find_if(beginIter, endIter,
+      [&](const FileInfo &f) { return !f.hash.empty() && f.isSameInode(*iter); });
+    if (leaderIter != endIter) {
+      iter->hash = leaderIter->hash;
+      iter->segmentHashVec = leaderIter->segmentHashVec;
     }
   }
-  if (removedCount) {
-    print_quiet("\nFiltered out {:n} single item or empty groups\n", removedCount);
+  auto hashedEndIter = std::partition(
+    beginIter, endIter, [](const FileInfo &f) { return !f.hash.empty() || f.matchId; });
+  auto getKey = [](const FileInfo &f) { return std::tie(f.hash, f.matchId); };
+  std::sort(beginIter, hashedEndIter,
+    [&](const FileInfo &a, const FileInfo &b) { return getKey(a) < getKey(b); });
+  GroupVec groupVec;
+  for (auto iter = beginIter; iter != hashedEndIter;) {
+    auto groupEndIter = std::find_if(
+      iter, hashedEndIter, [&](const FileInfo &f) { return getKey(f) != getKey(*iter); });
+    Group group(iter - std::begin(fileVec), groupEndIter - std::begin(fileVec));
+    if (hasMultipleInodes(fileVec, group)) {
+      groupVec.push_back(group);
+    }
+    iter = groupEndIter;
   }
+  sortAllFileInfoVec(fileVec, groupVec);
+  return groupVec;
 }
 
-// Calculate hashes for all files.
-void hashAll(FileVec &fileVec)
+// Add the groups that were confirmed since the last call to the session. The new groups are sorted
+// by themselves and merged into the display order, as in deleteMarkedFiles(), and groupIdx is moved
+// along so it stays on the group that is displayed. The rules are matched against the new groups
+// right away, including the rules that are still being evaluated, as their evaluations only cover
+// the groups there were when they started.
+void addHashedGroups(HashStream &hashStream, FileVec &fileVec, GroupVec &groupVec, Rules &rules,
+  StatsIndex &statsIndex, size_t &groupIdx)
 {
-  auto totalSizeOfUnhashed = getTotalSizeOfUnhashed(fileVec);
-  size_t accumulatedSize(0);
-  for (auto &fileInfo : fileVec) {
-    accumulatedSize += fileInfo.size;
-    try {
-      calculateHash(fileInfo);
-    }
-    catch (std::exception &e) {
-      fmt::print("\nIgnored file: {}\n", fileInfo.path.native());
-      print_verbose("Cause: {}\n", e.what());
-    }
-    displayHashStatus(
-      fileInfo, accumulatedSize, totalSizeOfUnhashed, fileVec.size(), fileVec.size());
+  GroupVec newGroupVec;
+  for (const auto &candidateGroup : hashStream.takeHashedGroups()) {
+    auto splitGroupVec = groupHashedFiles(fileVec, candidateGroup);
+    newGroupVec.insert(std::end(newGroupVec), std::begin(splitGroupVec), std::end(splitGroupVec));
+  }
+  if (newGroupVec.empty()) {
+    return;
+  }
+  sortGroupsBySize(fileVec, newGroupVec);
+  CompareGroupsBySize compareGroups(fileVec);
+  auto isDisplayed = !groupVec.empty();
+  auto displayedGroup =
+    isDisplayed ? groupVec[std::min(groupIdx, groupVec.size() - 1)] : Group(0, 0);
+  GroupVec mergedGroupVec;
+  mergedGroupVec.reserve(groupVec.size() + newGroupVec.size());
+  std::merge(std::begin(groupVec), std::end(groupVec), std::begin(newGroupVec),
+    std::end(newGroupVec), std::back_inserter(mergedGroupVec), compareGroups);
+  groupVec.swap(mergedGroupVec);
+  if (isDisplayed) {
+    groupIdx = std::lower_bound(std::begin(groupVec), std::end(groupVec), displayedGroup,
+                 compareGroups) -
+      std::begin(groupVec);
+  }
+  for (const auto &group : newGroupVec) {
+    statsIndex.addGroup(fileVec, group);
+  }
+  if (rules.getRuleCount()) {
+    RuleProgress progress;
+    auto matchVecVec = findRuleMatches(rules.getMatcher(0), fileVec, newGroupVec, progress);
+    commitRuleMatches(rules, 0, std::move(matchVecVec), fileVec, statsIndex);
   }
 }
 
-void calculateHash(FileInfo &fileInfo)
+void displayHashStreamStatus(const HashStream &hashStream)
 {
-  if (!fileInfo.hash.empty()) {
-    return;
-  }
-  if (USE_MD5_ARG) {
-    std::ifstream f(fileInfo.path.native(), std::ios::binary);
-    std::string ck(md5(f).digest().hex_str_value());
-    std::string wck(ck.begin(), ck.end());
-    fileInfo.hash = wck;
+  auto hashedBytes = hashStream.getHashedBytes();
+  auto totalBytes = hashStream.getTotalBytes();
+  print_quiet("\n    Hashing: {:.2f}% ({:L} / {:L} bytes), {:L} candidate groups left\n",
+    totalBytes ? (float)hashedBytes / (float)totalBytes * 100 : 100.0f, hashedBytes, totalBytes,
+    hashStream.getRemainingGroupCount());
+}
+
+void addRulesFromCommandLine(
+  Rules &rules, FileVec &fileVec, const GroupVec &groupVec, StatsIndex &statsIndex)
+{
+  auto beginRuleIdx = rules.getRuleCount();
+  for (auto &ruleArg : RULE_VEC_ARG) {
+    rules.addRegexRule(ruleArg);
   }
-  else {
-    fileInfo.hash = fnv1A64(fileInfo.path);
+  applyRules(rules, beginRuleIdx, fileVec, groupVec, statsIndex);
+}
+
+// Find the files matched by the rules from beginRuleIdx on, which are new, and count the groups of
+// the ones that became marked again. All the new rules are evaluated together.
+void applyRules(Rules &rules, size_t beginRuleIdx, FileVec &fileVec, const GroupVec &groupVec,
+  StatsIndex &statsIndex)
+{
+  RuleProgress progress;
+  auto matchVecVec = findRuleMatches(rules.getMatcher(beginRuleIdx), fileVec, groupVec, progress);
+  commitRuleMatches(rules, beginRuleIdx, std::move(matchVecVec), fileVec, statsIndex);
+}
+
+// The groups are split between the worker threads. Each worker collects its matches by itself, and
+// they are sorted into file order at the end, which is the order the rules keep them in. Returns
+// no matches if cancelled.
+std::vector<RuleMatchVec> findRuleMatches(const RuleMatcher &matcher, const FileVec &fileVec,
+  const GroupVec &groupVec, RuleProgress &progress)
+{
+  auto threadCount = getThreadCount();
+  // Matches by worker, then by rule.
+  std::vector<std::vector<RuleMatchVec>> workerMatchVec(
+    threadCount, std::vector<RuleMatchVec>(matcher.getRuleCount()));
+  std::atomic<size_t> nextGroupIdx(0);
+  runWorkers(
+    [&](size_t workerIdx) {
+      std::vector<size_t> ruleIdxVec;
+      for (;;) {
+        auto groupIdx = nextGroupIdx.fetch_add(1);
+        if (groupIdx >= groupVec.size() || progress.isCancelled) {
+          break;
+        }
+        const auto &group = groupVec[groupIdx];
+        for (size_t fileIdx = group.beginIdx; fileIdx < group.endIdx; ++fileIdx) {
+          matcher.findMatches(fileVec[fileIdx].path.native(), ruleIdxVec);
+          for (auto ruleIdx : ruleIdxVec) {
+            workerMatchVec[workerIdx][ruleIdx].emplace_back(group.beginIdx, fileIdx);
+          }
+          if (!ruleIdxVec.empty()) {
+            ++progress.matchCount;
+            progress.matchedBytes += fileVec[fileIdx].size;
+          }
+        }
+        ++progress.searchedGroupCount;
+      }
+    },
+    threadCount);
+
+  std::vector<RuleMatchVec> matchVecVec(matcher.getRuleCount());
+  if (progress.isCancelled) {
+    return matchVecVec;
+  }
+  for (size_t ruleIdx = 0; ruleIdx < matcher.getRuleCount(); ++ruleIdx) {
+    auto &matchVec = matchVecVec[ruleIdx];
+    for (auto &workerMatches : workerMatchVec) {
+      auto &ruleMatchVec = workerMatches[ruleIdx];
+      matchVec.insert(std::end(matchVec), std::begin(ruleMatchVec), std::end(ruleMatchVec));
+    }
+    std::sort(std::begin(matchVec), std::end(matchVec));
   }
-  print_verbose("{}: {}\n", USE_MD5_ARG ? "MD5 " : "FNV64", fileInfo.str());
+  return matchVecVec;
 }
 
-void displayHashStatus(const FileInfo &fileInfo, size_t accumulatedSize, size_t totalSize,
-  size_t fileCount, size_t fileIdx)
+// Add the matches of the rules from beginRuleIdx on to the ones they already have, and count the
+// groups of the files that became marked again. The new matches are in other groups than the ones
+// the rules already have.
+void commitRuleMatches(Rules &rules, size_t beginRuleIdx, std::vector<RuleMatchVec> matchVecVec,
+  FileVec &fileVec, StatsIndex &statsIndex)
 {
-  if (!QUIET_ARG && totalSize &&
-    (LAST_STATUS_TIME.elapsed() >= 1.0 || accumulatedSize == totalSize)) {
-    print_quiet("\nCalculating {} hashes:\n", USE_MD5_ARG ? "MD5" : "FNV64");
-    print_quiet("Data: {:.2f}% ({:n} / {:n} bytes)\n",
-      (float)accumulatedSize / (float)totalSize * 100, accumulatedSize, totalSize);
-    print_quiet("Files: {:.2f}% ({:n} / {:n} files)\n", (float)fileIdx / (float)fileCount * 100,
-      fileIdx, fileCount);
-    LAST_STATUS_TIME.restart();
-    print_quiet("\n");
+  std::vector<size_t> changedGroupBeginIdxVec;
+  for (size_t ruleIdx = 0; ruleIdx < matchVecVec.size(); ++ruleIdx) {
+    auto &matchVec = rules.getMatchVec(beginRuleIdx + ruleIdx);
+    auto &newMatchVec = matchVecVec[ruleIdx];
+    for (auto &match : newMatchVec) {
+      if (!fileVec[match.fileIdx].ruleMatchCount++) {
+        changedGroupBeginIdxVec.push_back(match.groupBeginIdx);
+      }
+    }
+    auto oldMatchCount = matchVec.size();
+    matchVec.insert(std::end(matchVec), std::begin(newMatchVec), std::end(newMatchVec));
+    std::inplace_merge(
+      std::begin(matchVec), std::begin(matchVec) + oldMatchCount, std::end(matchVec));
+  }
+  std::sort(std::begin(changedGroupBeginIdxVec), std::end(changedGroupBeginIdxVec));
+  changedGroupBeginIdxVec.erase(
+    std::unique(std::begin(changedGroupBeginIdxVec), std::end(changedGroupBeginIdxVec)),
+    std::end(changedGroupBeginIdxVec));
+  for (auto groupBeginIdx : changedGroupBeginIdxVec) {
+    statsIndex.updateGroup(fileVec, groupBeginIdx);
   }
 }
 
-// Sum up the total size of files to hash. The vector may include entries imported from md5 files,
-// which includes hash.
-size_t getTotalSizeOfUnhashed(FileVec &fileVec)
+// Apply the matches of the rules whose evaluations have finished. Evaluations that are still
+// running are given until the timeout, shared between them, or with isWait, as long as they take.
+void collectRuleEvaluations(Rules &rules, FileVec &fileVec, StatsIndex &statsIndex, bool isWait)
 {
-  size_t totalSize(0);
-  for (const auto &fileInfo : fileVec) {
-    if (fileInfo.hash.empty()) {
-      totalSize += fileInfo.size;
+  auto deadline = std::chrono::steady_clock::now() + RULE_EVALUATION_WAIT;
+  for (size_t ruleIdx = 0; ruleIdx < rules.getRuleCount(); ++ruleIdx) {
+    auto evaluation = rules.getEvaluation(ruleIdx);
+    if (!evaluation) {
+      continue;
+    }
+    auto timeout = std::max(std::chrono::duration_cast<std::chrono::milliseconds>(
+                              deadline - std::chrono::steady_clock::now()),
+      std::chrono::milliseconds(0));
+    if (!isWait && !evaluation->waitFor(timeout)) {
+      continue;
     }
+    auto matchVecVec = evaluation->getMatchVecVec();
+    rules.setEvaluation(ruleIdx, nullptr);
+    commitRuleMatches(rules, ruleIdx, std::move(matchVecVec), fileVec, statsIndex);
   }
-  return totalSize;
 }
 
-HashToGroupMap groupFilesByHash(const FileVec &fileVec)
+// Add a rule for a single file. Paths are unique, so the file is the only match, and the rule takes
+// effect without searching.
+void applyPathRule(
+  Rules &rules, const Group &group, size_t fileIdx, FileVec &fileVec, StatsIndex &statsIndex)
 {
-  HashToGroupMap hashToGroupMap;
-  for (const auto &fileInfo : fileVec) {
-    hashToGroupMap[fileInfo.hash].push_back(fileInfo);
+  rules.addPathRule(fileVec[fileIdx].path);
+  rules.getMatchVec(rules.getRuleCount() - 1).emplace_back(group.beginIdx, fileIdx);
+  if (!fileVec[fileIdx].ruleMatchCount++) {
+    statsIndex.updateGroup(fileVec, group.beginIdx);
   }
-  return hashToGroupMap;
 }
 
-void addRulesFromCommandLine(Rules &rules)
+// Remove a rule. Only the files the rule matched are visited, and only the groups of the ones that
+// are no longer matched by any rule are counted again. If the rule is still being evaluated, the
+// evaluation is cancelled, and only the matches in groups added since it started are undone.
+void eraseRule(Rules &rules, size_t ruleIdx, FileVec &fileVec, StatsIndex &statsIndex)
 {
-  for (auto &ruleArg : RULE_VEC_ARG) {
-    rules.addRegexRule(ruleArg);
+  auto &matchVec = rules.getMatchVec(ruleIdx);
+  // The matches of each group are next to each other.
+  for (size_t matchIdx = 0; matchIdx < matchVec.size();) {
+    auto groupBeginIdx = matchVec[matchIdx].groupBeginIdx;
+    bool isChanged = false;
+    for (; matchIdx < matchVec.size() && matchVec[matchIdx].groupBeginIdx == groupBeginIdx;
+         ++matchIdx) {
+      isChanged |= !--fileVec[matchVec[matchIdx].fileIdx].ruleMatchCount;
+    }
+    if (isChanged) {
+      statsIndex.updateGroup(fileVec, groupBeginIdx);
+    }
   }
+  rules.eraseRule(ruleIdx);
 }
 
-// Sort the FileVec in each group by the paths.
-void sortAllFileInfoVec(HashToGroupMap &hashToGroupMap)
+// Sort the files in each group by the paths.
+void sortAllFileInfoVec(FileVec &fileVec, const GroupVec &groupVec)
 {
-  for (auto &groupPair : hashToGroupMap) {
-    std::sort(std::begin(groupPair.second), std::end(groupPair.second),
+  for (const auto &group : groupVec) {
+    std::sort(std::begin(fileVec) + group.beginIdx, std::begin(fileVec) + group.endIdx,
       [](const FileInfo &a, const FileInfo &b) { return a.path < b.path; });
   }
 }
 
-GroupsBySizeVec sortGroupsBySize(const HashToGroupMap &hashToGroupMap)
+void sortGroupsBySize(const FileVec &fileVec, GroupVec &groupVec)
 {
-  GroupsBySizeVec groupsBySize;
-  for (auto &groupPair : hashToGroupMap) {
-    groupsBySize.push_back(groupPair.first);
-  }
+  std::sort(std::begin(groupVec), std::end(groupVec), CompareGroupsBySize(fileVec));
+}
 
-  std::sort(std::begin(groupsBySize), std::end(groupsBySize), CompareGroupsByHash(hashToGroupMap));
-  return groupsBySize;
+// Sort the groups into the same order as their files have in the table. Required before compacting
+// the table.
+void sortGroupsByIdx(GroupVec &groupVec)
+{
+  std::sort(std::begin(groupVec), std::end(groupVec),
+    [](const Group &a, const Group &b) { return a.beginIdx < b.beginIdx; });
 }
 
-// Start interactive section.
-void addRulesInteractive(Rules &rules, HashToGroupMap &groupMap)
+// Start interactive section. The groups are kept in display order, so moving between them is just a
+// change of index. Only delete changes the groups, and it keeps them in order. With a hash stream,
+// the groups that have been confirmed since the last command are added before each prompt.
+void addRulesInteractive(Rules &rules, FileVec &fileVec, GroupVec &groupVec,
+  StatsIndex &statsIndex, HashStream *hashStream)
 {
   bool doDisplayHelp = true;
   size_t groupIdx = 0;
-  GroupsBySizeVec groupsBySize;
   std::string errorMsg;
   fmt::print("\n");
 
   for (;;) {
-    refreshGroups(groupsBySize, groupMap);
-    // Exit if no more groups.
-    if (groupMap.empty()) {
+    if (hashStream) {
+      addHashedGroups(*hashStream, fileVec, groupVec, rules, statsIndex, groupIdx);
+    }
+    // Exit if no more groups. While hashing runs, wait for the first ones instead.
+    if (groupVec.empty()) {
+      if (hashStream && !hashStream->isDone()) {
+        displayHashStreamStatus(*hashStream);
+        hashStream->waitForGroups(std::chrono::seconds(1));
+        continue;
+      }
       if (!QUIET_ARG) {
         print_quiet("\nNo more duplicates found\n");
       }
       return;
     }
-    const auto &groupFileVec = groupMap[groupsBySize[groupIdx]];
-    auto totalStats = getTotalStats(groupMap, rules);
+    // Deleting files may have removed groups.
+    groupIdx = std::min(groupIdx, groupVec.size() - 1);
+    const auto group = groupVec[groupIdx];
+    collectRuleEvaluations(rules, fileVec, statsIndex, false);
+    auto totalStats = statsIndex.getTotalStats();
     displayRules(rules);
-    displayGroup(groupFileVec, rules, groupIdx, totalStats.groupCount);
+    displayGroup(fileVec, group, statsIndex, groupIdx, totalStats.groupCount);
     displayTotalStats(totalStats);
+    if (hashStream && !hashStream->isDone()) {
+      displayHashStreamStatus(*hashStream);
+    }
     if (doDisplayHelp) {
       doDisplayHelp = false;
       displayHelp();
@@ -639,8 +2493,8 @@ void addRulesInteractive(Rules &rules, HashToGroupMap &groupMap)
       if (cmd == "quit" || cmd == "exit") {
         return;
       }
-      procCommand(
-        groupIdx, doDisplayHelp, rules, totalStats, groupFileVec, cmd, arg, groupMap);
+      procCommand(groupIdx, doDisplayHelp, rules, totalStats, group, cmd, arg, fileVec, groupVec,
+        statsIndex);
     }
     catch (const std::runtime_error &e) {
       errorMsg = e.what();
@@ -649,17 +2503,19 @@ void addRulesInteractive(Rules &rules, HashToGroupMap &groupMap)
 }
 
 void procCommand(size_t &groupIdx, bool &doDisplayHelp, Rules &rules, const Stats &totalStats,
-  const FileVec &groupFileVec, const std::string &cmd, const std::string &arg, HashToGroupMap &groupMap)
+  const Group &group, const std::string &cmd, const std::string &arg, FileVec &fileVec,
+  GroupVec &groupVec, StatsIndex &statsIndex)
 {
   if (cmd == "delete") {
-    if (!totalStats.markedBytes) {
+    // All the rules must be applied before deleting.
+    collectRuleEvaluations(rules, fileVec, statsIndex, true);
+    const auto &markedStats = statsIndex.getTotalStats();
+    if (!markedStats.markedBytes) {
       throw std::runtime_error("Nothing to delete yet");
     }
     // Prompt for confirmation then delete the currently marked files.
-    if(confirmDeletePrompt(totalStats)){
-      deleteMarkedFiles(groupMap, rules);
-      removeSingleItemGroups(groupMap);
-      rules.clear();
+    if(confirmDeletePrompt(markedStats)){
+      deleteMarkedFiles(fileVec, groupVec, rules, statsIndex);
     }
   }
   else if (cmd == "f" || cmd == "first") {
@@ -688,15 +2544,19 @@ void procCommand(size_t &groupIdx, bool &doDisplayHelp, Rules &rules, const Stat
   }
   // Add path rule if cmd is a number.
   else if (isInt(cmd)) {
-    rules.addPathRule(groupFileVec[argToIdx(cmd, groupFileVec.size()) - 1].path);
+    auto fileIdx = group.beginIdx + argToIdx(cmd, group.size()) - 1;
+    applyPathRule(rules, group, fileIdx, fileVec, statsIndex);
   }
-  // Add regex rule if cmd is a regex.
+  // Add regex rule if cmd is a regex. It's evaluated in the background.
   else if (cmd.size() >= 2) {
     rules.addRegexRule(cmd);
+    auto ruleIdx = rules.getRuleCount() - 1;
+    rules.setEvaluation(
+      ruleIdx, std::make_unique<RuleEvaluation>(rules.getMatcher(ruleIdx), fileVec, groupVec));
   }
   // Erase a rule.
   else if (cmd == "d" || cmd == "remove") {
-    rules.eraseRule(argToIdx(arg, rules.getRuleCount()));
+    eraseRule(rules, argToIdx(arg, rules.getRuleCount()) - 1, fileVec, statsIndex);
   }
   // Display help.
   else if (cmd == "h" || cmd == "help" || cmd == "?") {
@@ -711,7 +2571,7 @@ void procCommand(size_t &groupIdx, bool &doDisplayHelp, Rules &rules, const Stat
 void commandPrompt(std::string &cmd, std::string &arg, const size_t groupIdx, const size_t groupCount)
 {
   std::string cmdline;
-  fmt::print("\n    {:n} / {:n} > ", groupIdx + 1, groupCount);
+  fmt::print("\n    {:L} / {:L} > ", groupIdx + 1, groupCount);
   std::cout << std::flush;
   getline(std::cin, cmdline);
   // Split command into command and argument.
@@ -753,12 +2613,6 @@ size_t argToIdx(const std::string &arg, const size_t &maxIdx)
   return idx;
 }
 
-void refreshGroups(GroupsBySizeVec &groupsBySize, HashToGroupMap &groupMap)
-{
-  removeSingleItemGroups(groupMap);
-  groupsBySize = sortGroupsBySize(groupMap);
-}
-
 void displayRules(const Rules &rules)
 {
   auto ruleVec = rules.getRulesForDisplay();
@@ -767,39 +2621,83 @@ void displayRules(const Rules &rules)
     fmt::print("{:<15}No rules defined\n", "");
   }
   else {
-    int ruleIdx(0);
-    for (const auto &r : ruleVec) {
-      fmt::print("{:>14n} {}\n", ++ruleIdx, r);
+    for (size_t ruleIdx = 0; ruleIdx < ruleVec.size(); ++ruleIdx) {
+      auto evaluation = rules.getEvaluation(ruleIdx);
+      fmt::print("{:>14L} {}{}\n", ruleIdx + 1, ruleVec[ruleIdx],
+        evaluation ? getEvaluationStatus(*evaluation) : "");
     }
   }
 }
 
-void displayGroup(
-  const FileVec &fileVec, const Rules &rules, const size_t groupIdx, const size_t groupCount)
+void displayGroup(const FileVec &fileVec, const Group &group, const StatsIndex &statsIndex,
+  const size_t groupIdx, const size_t groupCount)
 {
   fmt::print("\n    Duplicates:\n", groupIdx + 1, groupCount);
-  size_t fileIdx = 0;
   size_t matchedCount = 0;
   auto allAreMarked = false;
-  for (const auto &fileInfo : fileVec) {
+  auto linkNumVec = getLinkNumVec(fileVec, group);
+  for (size_t fileIdx = group.beginIdx; fileIdx < group.endIdx; ++fileIdx) {
+    const auto &fileInfo = fileVec[fileIdx];
     auto markerStr = " ";
-    if (rules.isMatch(fileInfo)) {
+    if (fileInfo.ruleMatchCount) {
       // Don't mark the last file in the group if it would cause all files in the group to be
       // marked. This is to ensure that the program never deletes all files in a group.
-      allAreMarked = ++matchedCount == fileVec.size();
+      allAreMarked = ++matchedCount == group.size();
       markerStr = allAreMarked ? "P" : "*";
     }
-    fmt::print("{:>9}{} {:>3n} {}\n", "", markerStr, ++fileIdx, fileInfo.path.native());
+    auto linkNum = linkNumVec[fileIdx - group.beginIdx];
+    fmt::print("{:>9}{} {:>3L} {}{}\n", "", markerStr, fileIdx - group.beginIdx + 1,
+      fileInfo.path.native(), linkNum ? fmt::format(" (hard link {})", linkNum) : "");
   }
   if (allAreMarked) {
     fmt::print("\n{:>14} To preserve one copy, the matching file marked with P will NOT be deleted\n", "");
   }
-  auto groupStats = getGroupStats(fileVec, rules);
+  const auto &groupStats = statsIndex.getGroupStats(group);
+  const auto &firstFileInfo = fileVec[group.beginIdx];
   fmt::print("\n");
-  fmt::print("{:>14n} bytes per file, all with hash {}\n", fileVec[0].size, fileVec[0].hash);
-  fmt::print("{:>14n} bytes in group\n", groupStats.totalBytes);
-  fmt::print("{:>14n} bytes in duplicates\n", groupStats.dupBytes);
-  fmt::print("{:>14n} bytes in marked files\n", groupStats.markedBytes);
+  if (firstFileInfo.hash.empty()) {
+    fmt::print("{:>14L} bytes per file, all compared byte by byte\n", firstFileInfo.size);
+  }
+  else {
+    fmt::print(
+      "{:>14L} bytes per file, all with hash {}\n", firstFileInfo.size, firstFileInfo.hash);
+  }
+  fmt::print("{:>14L} bytes in group\n", groupStats.totalBytes);
+  fmt::print("{:>14L} bytes in duplicates\n", groupStats.dupBytes);
+  fmt::print("{:>14L} bytes in marked files\n", groupStats.markedBytes);
+}
+
+// Show how far the evaluation of a rule has come. The counts are of the files matched so far.
+std::string getEvaluationStatus(const RuleEvaluation &evaluation)
+{
+  const auto &progress = evaluation.getProgress();
+  return fmt::format(" (evaluating {:.0f}%, {:L} matches and {:L} bytes so far)",
+    evaluation.getGroupCount()
+      ? (float)progress.searchedGroupCount / (float)evaluation.getGroupCount() * 100
+      : 100.0f,
+    progress.matchCount.load(), progress.matchedBytes.load());
+}
+
+// Number the sets of hard links in a group, so they can be told apart in the group view. Files that
+// have no other links in the group get 0.
+std::vector<size_t> getLinkNumVec(const FileVec &fileVec, const Group &group)
+{
+  std::vector<size_t> linkNumVec(group.size(), 0);
+  size_t linkNum = 0;
+  for (size_t i = 0; i < group.size(); ++i) {
+    if (linkNumVec[i]) {
+      continue;
+    }
+    for (size_t j = i + 1; j < group.size(); ++j) {
+      if (fileVec[group.beginIdx + i].isSameInode(fileVec[group.beginIdx + j])) {
+        if (!linkNumVec[i]) {
+          linkNumVec[i] = ++linkNum;
+        }
+        linkNumVec[j] = linkNum;
+      }
+    }
+  }
+  return linkNumVec;
 }
 
 void displayHelp()
@@ -820,13 +2718,13 @@ void displayHelp()
 void displayTotalStats(const Stats &stats)
 {
   fmt::print("\n    Total:\n");
-  fmt::print("{:>14n} files\n", stats.totalCount);
-  fmt::print("{:>14n} groups\n", stats.groupCount);
-  fmt::print("{:>14n} duplicates\n", stats.dupCount);
-  fmt::print("{:>14n} marked files\n", stats.markedCount);
-  fmt::print("{:>14n} bytes in all groups\n", stats.totalBytes);
-  fmt::print("{:>14n} bytes in duplicates\n", stats.dupBytes);
-  fmt::print("{:>14n} bytes in all marked files\n", stats.markedBytes);
+  fmt::print("{:>14L} files\n", stats.totalCount);
+  fmt::print("{:>14L} groups\n", stats.groupCount);
+  fmt::print("{:>14L} duplicates\n", stats.dupCount);
+  fmt::print("{:>14L} marked files\n", stats.markedCount);
+  fmt::print("{:>14L} bytes in all groups\n", stats.totalBytes);
+  fmt::print("{:>14L} bytes in duplicates\n", stats.dupBytes);
+  fmt::print("{:>14L} bytes in all marked files\n", stats.markedBytes);
   fmt::print(
     "{:>14.2f} files per group (average)\n", (float)stats.totalCount / (float)stats.groupCount);
 }
@@ -835,7 +2733,7 @@ bool confirmDeletePrompt(const Stats &totalStats)
 {
   fmt::print("\n");
   while (true) {
-    fmt::print("About to delete {:n} files ({:n} bytes) Delete? (y/n) > ", totalStats.markedCount,
+    fmt::print("About to delete {:L} files ({:L} bytes) Delete? (y/n) > ", totalStats.markedCount,
       totalStats.markedBytes);
     std::cout << std::flush;
     std::string cmdline;
@@ -849,28 +2747,66 @@ bool confirmDeletePrompt(const Stats &totalStats)
   }
 }
 
-void deleteMarkedFiles(HashToGroupMap &groupMap, const Rules &rules)
+// Delete the marked files. As in getGroupStats(), the last file in a group is never deleted. Only
+// the groups with marked files are changed. The remaining files of such a group are moved to the
+// front of its range in the file table, and the range is shrunk to fit, so the table is not
+// compacted. The changed groups may have a new first file, which decides their place among groups
+// of the same size, so they are taken out, sorted by themselves and merged back in, instead of
+// sorting all the groups again. Changed groups that are left with a single inode are dropped. The
+// stats of the changed groups are swapped out of the totals, and the rules are cleared.
+void deleteMarkedFiles(FileVec &fileVec, GroupVec &groupVec, Rules &rules, StatsIndex &statsIndex)
 {
   size_t deletedCount = 0;
   size_t deleteIdx = 0;
-  auto totalStats = getTotalStats(groupMap, rules);
-
-  for (auto &groupPair : groupMap) {
-    auto &fileVec = groupPair.second;
-    auto fileIter = fileVec.begin();
-    while (fileIter != fileVec.end()) {
-      if (rules.isMatch(*fileIter)) {
-        if (deleteFile(*fileIter)) {
+  auto totalStats = statsIndex.getTotalStats();
+
+  GroupVec changedGroupVec;
+  size_t removedCount = 0;
+  size_t dstGroupIdx = 0;
+  for (size_t groupIdx = 0; groupIdx < groupVec.size(); ++groupIdx) {
+    auto group = groupVec[groupIdx];
+    size_t dstFileIdx = group.beginIdx;
+    size_t markedCount = 0;
+    for (size_t fileIdx = group.beginIdx; fileIdx < group.endIdx; ++fileIdx) {
+      if (fileVec[fileIdx].ruleMatchCount && markedCount != group.size() - 1) {
+        ++markedCount;
+        if (deleteFile(fileVec[fileIdx])) {
           ++deletedCount;
         }
-        fileIter = fileVec.erase(fileIter);
+        ++deleteIdx;
+        displayDeleteStatus(totalStats, deleteIdx, deletedCount);
+        continue;
       }
-      else {
-        ++fileIter;
+      fileVec[fileIdx].ruleMatchCount = 0;
+      if (fileIdx != dstFileIdx) {
+        fileVec[dstFileIdx] = std::move(fileVec[fileIdx]);
       }
-      ++deleteIdx;
-      displayDeleteStatus(totalStats, deleteIdx, deletedCount);
+      ++dstFileIdx;
+    }
+    if (!markedCount) {
+      groupVec[dstGroupIdx++] = group;
+      continue;
+    }
+    statsIndex.removeGroup(group);
+    Group changedGroup(group.beginIdx, dstFileIdx);
+    if (hasMultipleInodes(fileVec, changedGroup)) {
+      changedGroupVec.push_back(changedGroup);
+      statsIndex.addGroup(fileVec, changedGroup);
     }
+    else {
+      ++removedCount;
+    }
+  }
+  groupVec.erase(std::begin(groupVec) + dstGroupIdx, std::end(groupVec));
+  sortGroupsBySize(fileVec, changedGroupVec);
+  GroupVec mergedGroupVec;
+  mergedGroupVec.reserve(groupVec.size() + changedGroupVec.size());
+  std::merge(std::begin(groupVec), std::end(groupVec), std::begin(changedGroupVec),
+    std::end(changedGroupVec), std::back_inserter(mergedGroupVec), CompareGroupsBySize(fileVec));
+  groupVec.swap(mergedGroupVec);
+  rules.clear();
+  if (removedCount) {
+    print_quiet("\nFiltered out {:L} single item or empty groups\n", removedCount);
   }
 }
 
@@ -903,48 +2839,267 @@ void displayDeleteStatus(const Stats &totalStats, const size_t deleteIdx, const
   if (QUIET_ARG || (LAST_STATUS_TIME.elapsed() < 1.0)) {
     return;
   }
-  print_quiet("Deleting files: {:.2f}% ({:n} / {:n})\n",
+  print_quiet("Deleting files: {:.2f}% ({:L} / {:L})\n",
     (float)deleteIdx / (float)totalStats.markedCount * 100, deleteIdx, totalStats.markedCount);
-  print_quiet("Failed: {:n} markedFiles\n", deleteIdx - deletedCount);
+  print_quiet("Failed: {:L} markedFiles\n", deleteIdx - deletedCount);
   LAST_STATUS_TIME.restart();
 }
 
-Stats getGroupStats(const FileVec &groupFileVec, const Rules &rules)
+// File counts are by path, while byte counts are by inode. Hard links to the same inode take up
+// space only once, and the space is freed only when all the links to the inode are deleted,
+// including links outside of the search folders.
+Stats getGroupStats(const FileVec &fileVec, const Group &group)
 {
   Stats stats;
-  size_t fileIdx = 0;
-  for (const auto &fileInfo : groupFileVec) {
+  stats.groupCount = 1;
+  std::vector<char> isMarkedVec(group.size(), false);
+  for (size_t fileIdx = group.beginIdx; fileIdx < group.endIdx; ++fileIdx) {
+    const auto &fileInfo = fileVec[fileIdx];
     stats.totalCount += 1;
-    stats.totalBytes += fileInfo.size;
-    stats.groupCount = 1;
-    if (fileIdx) {
+    if (fileIdx != group.beginIdx) {
       stats.dupCount += 1;
-      stats.dupBytes += fileInfo.size;
     }
-    if (rules.isMatch(fileInfo)) {
+    if (fileInfo.ruleMatchCount) {
       // Don't mark the last file in the group if it would cause all files in the group to be
       // marked. This is to ensure that the program never deletes all files in a group.
-      if (stats.markedCount != groupFileVec.size() - 1) {
+      if (stats.markedCount != group.size() - 1) {
         stats.markedCount += 1;
-        stats.markedBytes += fileInfo.size;
+        isMarkedVec[fileIdx - group.beginIdx] = true;
+      }
+    }
+  }
+  auto size = fileVec[group.beginIdx].size;
+  size_t inodeCount = 0;
+  for (size_t i = 0; i < group.size(); ++i) {
+    const auto &fileInfo = fileVec[group.beginIdx + i];
+    size_t linkCount = 0;
+    size_t markedLinkCount = 0;
+    bool isFirstLink = true;
+    for (size_t j = 0; j < group.size(); ++j) {
+      if (j == i || fileInfo.isSameInode(fileVec[group.beginIdx + j])) {
+        isFirstLink &= j >= i;
+        ++linkCount;
+        markedLinkCount += isMarkedVec[j];
+      }
+    }
+    if (isFirstLink) {
+      ++inodeCount;
+      if (markedLinkCount == std::max<u64>(linkCount, fileInfo.nlink)) {
+        stats.markedBytes += size;
       }
     }
-    ++fileIdx;
   }
+  stats.totalBytes = size * inodeCount;
+  stats.dupBytes = size * (inodeCount - 1);
   return stats;
 }
 
-Stats getTotalStats(const HashToGroupMap &groupMap, const Rules &rules)
+// The evaluation holds its own copies of the matcher and the groups, which the thread refers to.
+RuleEvaluation::RuleEvaluation(RuleMatcher matcher, const FileVec &fileVec, GroupVec groupVec)
+  : matcher(std::move(matcher)), groupVec(std::move(groupVec))
 {
-  Stats stats;
-  for (const auto &group : groupMap) {
-    auto groupStats = getGroupStats(group.second, rules);
-    stats += groupStats;
+  future = std::async(std::launch::async, [this, &fileVec]() {
+    return findRuleMatches(this->matcher, fileVec, this->groupVec, progress);
+  });
+}
+
+RuleEvaluation::~RuleEvaluation()
+{
+  progress.isCancelled = true;
+  if (future.valid()) {
+    future.wait();
   }
-  return stats;
 }
 
-// Switch from C locale to user's locale. This works together with fmt "{:n}" for adding thousand
+bool RuleEvaluation::waitFor(std::chrono::milliseconds timeout)
+{
+  return future.wait_for(timeout) == std::future_status::ready;
+}
+
+std::vector<RuleMatchVec> RuleEvaluation::getMatchVecVec()
+{
+  return future.get();
+}
+
+const RuleProgress &RuleEvaluation::getProgress() const
+{
+  return progress;
+}
+
+size_t RuleEvaluation::getGroupCount() const
+{
+  return groupVec.size();
+}
+
+StatsIndex::StatsIndex(const FileVec &fileVec, const GroupVec &groupVec)
+{
+  groupStatsMap.reserve(groupVec.size());
+  for (const auto &group : groupVec) {
+    addGroup(fileVec, group);
+  }
+}
+
+void StatsIndex::addGroup(const FileVec &fileVec, const Group &group)
+{
+  auto stats = ::getGroupStats(fileVec, group);
+  totalStats += stats;
+  groupStatsMap[group.beginIdx] = GroupStats{group.endIdx, stats};
+}
+
+void StatsIndex::removeGroup(const Group &group)
+{
+  auto iter = groupStatsMap.find(group.beginIdx);
+  totalStats -= iter->second.stats;
+  groupStatsMap.erase(iter);
+}
+
+void StatsIndex::updateGroup(const FileVec &fileVec, size_t beginIdx)
+{
+  Group group(beginIdx, groupStatsMap.at(beginIdx).endIdx);
+  removeGroup(group);
+  addGroup(fileVec, group);
+}
+
+const Stats &StatsIndex::getGroupStats(const Group &group) const
+{
+  return groupStatsMap.at(group.beginIdx).stats;
+}
+
+const Stats &StatsIndex::getTotalStats() const
+{
+  return totalStats;
+}
+
+// The order of the files is decided here, before the hashing thread starts, as it's the only time
+// all the files are read by the main thread. The groups are ordered by the space they could free,
+// which is the file size times the number of duplicates, and their files are hashed group by
+// group. Groups that don't need hashing, such as the ones that were compared directly or imported
+// with their hashes, are handed over right away.
+HashStream::HashStream(FileVec &fileVec, GroupVec candidateGroupVec)
+  : fileVec(fileVec), candidateGroupVec(std::move(candidateGroupVec)),
+    fileGroupIdxVec(fileVec.size()),
+    remainingCountVec(new std::atomic<size_t>[this->candidateGroupVec.size()])
+{
+  const auto &groupVec = this->candidateGroupVec;
+  std::vector<size_t> groupIdxVec(groupVec.size());
+  for (size_t groupIdx = 0; groupIdx < groupVec.size(); ++groupIdx) {
+    groupIdxVec[groupIdx] = groupIdx;
+  }
+  auto getSavings = [&](size_t groupIdx) {
+    return fileVec[groupVec[groupIdx].beginIdx].size * (groupVec[groupIdx].size() - 1);
+  };
+  std::stable_sort(std::begin(groupIdxVec), std::end(groupIdxVec),
+    [&](size_t a, size_t b) { return getSavings(a) > getSavings(b); });
+  auto leaderIdxVec = getLinkLeaderIdxVec(fileVec);
+  std::vector<size_t> fileIdxVec;
+  for (auto groupIdx : groupIdxVec) {
+    const auto &group = groupVec[groupIdx];
+    size_t remainingCount = 0;
+    for (size_t fileIdx = group.beginIdx; fileIdx < group.endIdx; ++fileIdx) {
+      fileGroupIdxVec[fileIdx] = groupIdx;
+      const auto &fileInfo = fileVec[fileIdx];
+      if (leaderIdxVec[fileIdx] != fileIdx || fileInfo.matchId || !fileInfo.hash.empty()) {
+        continue;
+      }
+      fileIdxVec.push_back(fileIdx);
+      ++remainingCount;
+      totalBytes += fileInfo.size;
+    }
+    remainingCountVec[groupIdx] = remainingCount;
+    if (!remainingCount) {
+      hashedGroupVec.push_back(group);
+    }
+  }
+  // The session stops waiting for groups when hashing ends, also if it ends with an error, which is
+  // passed on by stop().
+  future = std::async(std::launch::async, [this, &fileVec, fileIdxVec]() {
+    std::exception_ptr error;
+    try {
+      hashFiles(fileVec, fileIdxVec,
+        [this](size_t fileIdx, bool isUnhashed) { onFileDone(fileIdx, isUnhashed); });
+    }
+    catch (...) {
+      error = std::current_exception();
+    }
+    std::lock_guard<std::mutex> lock(mutex);
+    isHashingDone = true;
+    hashedCondition.notify_all();
+    if (error) {
+      std::rethrow_exception(error);
+    }
+  });
+}
+
+HashStream::~HashStream()
+{
+  IS_HASHING_STOPPED = true;
+  if (future.valid()) {
+    future.wait();
+  }
+}
+
+GroupVec HashStream::takeHashedGroups()
+{
+  std::lock_guard<std::mutex> lock(mutex);
+  GroupVec groupVec;
+  groupVec.swap(hashedGroupVec);
+  takenCount += groupVec.size();
+  return groupVec;
+}
+
+void HashStream::waitForGroups(std::chrono::milliseconds timeout)
+{
+  std::unique_lock<std::mutex> lock(mutex);
+  hashedCondition.wait_for(
+    lock, timeout, [this]() { return !hashedGroupVec.empty() || isHashingDone; });
+}
+
+bool HashStream::isDone()
+{
+  std::lock_guard<std::mutex> lock(mutex);
+  return isHashingDone && hashedGroupVec.empty();
+}
+
+void HashStream::stop()
+{
+  IS_HASHING_STOPPED = true;
+  if (future.valid()) {
+    future.get();
+  }
+}
+
+u64 HashStream::getHashedBytes() const
+{
+  return hashedBytes;
+}
+
+u64 HashStream::getTotalBytes() const
+{
+  return totalBytes;
+}
+
+size_t HashStream::getRemainingGroupCount() const
+{
+  return candidateGroupVec.size() - takenCount;
+}
+
+// Called by the hashing threads. The thread that finishes the last file of a group hands the group
+// over, and the counter makes sure the hashes of the other files in the group are visible by then.
+void HashStream::onFileDone(size_t fileIdx, bool isUnhashed)
+{
+  if (isUnhashed) {
+    hashedBytes += fileVec[fileIdx].size;
+  }
+  auto groupIdx = fileGroupIdxVec[fileIdx];
+  if (--remainingCountVec[groupIdx]) {
+    return;
+  }
+  std::lock_guard<std::mutex> lock(mutex);
+  hashedGroupVec.push_back(candidateGroupVec[groupIdx]);
+  hashedCondition.notify_all();
+}
+
+// Switch from C locale to user's locale. This works together with fmt "{:L}" for adding thousand
 // grouping to all ints for US locale and hopefully most others.
 void setupLocale()
 {
@@ -962,12 +3117,49 @@ void parseCommandLine(int argc, char **argv)
       "filter-large,b", po::value<size_t>(&IGNORE_LARGER_ARG), "ignore files of this size and larger")(
       "quiet,q", po::bool_switch(&QUIET_ARG), "display only error messages")("verbose,v",
       po::bool_switch(&VERBOSE_ARG), "display verbose messages")("debug,e", po::bool_switch(&DEBUG_ARG),
-      "display debug / optimization info")("md5,5", po::bool_switch(&USE_MD5_ARG),
-      "use md5 cryptographic hash (fnv 64 bit hash is used by default)")("rule,u",
+      "display debug / optimization info")("hash,H", po::value<std::string>(&HASH_ALGO_ARG),
+      "hash algorithm: wide128 (default, 128 bit), fnv64 or md5")("md5,5",
+      po::bool_switch(&USE_MD5_ARG), "use md5 cryptographic hash (same as --hash md5)")("threads,t",
+      po::value<size_t>(&THREAD_COUNT_ARG), "number of worker threads (default: number of CPU cores)")("partial-size,k",
+      po::value<size_t>(&PARTIAL_HASH_SIZE_ARG),
+      "size of first and last blocks hashed before full hashing (default: 4096, 0: disable)")(
+      "tree-segment,T", po::value<size_t>(&TREE_SEGMENT_SIZE_ARG),
+      "hash files larger than this many MiB in segments of this size in parallel (default: 0, "
+      "disable)")("io-policy,P", po::value<std::string>(&IO_POLICY_ARG),
+      "how files are read: cached (default), sequential (drop read data from the page cache) or "
+      "direct (bypass the page cache)")("readahead", po::value<size_t>(&READAHEAD_ARG),
+      "KiB to read ahead of the hashing position (default: 0, kernel default)")("io-uring",
+      po::bool_switch(&IO_URING_ARG),
+      "read files for full hashing with io_uring, with many reads in flight (Linux)")(
+      "disk-order", po::value<std::string>(&DISK_ORDER_ARG),
+      "hash files in the order they are stored on disk: auto (default, on rotational disks), "
+      "always or never")("device-threads",
+      po::value<std::vector<std::string>>(&DEVICE_THREADS_VEC_ARG),
+      "hash files on the device that holds PATH with N threads, given as PATH=N (default: 1 for "
+      "rotational disks, the thread count for others)")("rule,u",
       po::value<std::vector<std::string>>(&RULE_VEC_ARG),
       "add marking rule (case insensitive regex)")("rfolder,r",
       po::value<std::vector<fs::path>>(&RECURSIVE_PATH_VEC_ARG), "add recursive search folder")("md5list,m",
       po::value<std::vector<fs::path>>(&MD5_PATH_VEC_ARG), "add md5 list file (output from md5deep -zr)")(
+      "verify-md5list",
+      po::bool_switch(&VERIFY_MD5_LIST_ARG),
+      "stat the files in md5 lists and manifests and hash the ones that changed since they were "
+      "written")("manifest", po::value<std::vector<fs::path>>(&MANIFEST_PATH_VEC_ARG),
+      "add manifest file (written by --export-manifest)")("export-md5list",
+      po::value<fs::path>(&EXPORT_MD5_LIST_ARG),
+      "hash all files and write them to an md5 list (md5deep -zr format)")("export-manifest",
+      po::value<fs::path>(&EXPORT_MANIFEST_ARG),
+      "hash all files and write them to a binary manifest, with inodes and modification times")(
+      "cache,c",
+      po::value<fs::path>(&HASH_CACHE_PATH_ARG), "keep hashes in cache file for later runs")(
+      "compact-cache", po::bool_switch(&COMPACT_CACHE_ARG),
+      "drop cached hashes of files that were not seen in this run")("checkpoint",
+      po::value<fs::path>(&CHECKPOINT_PATH_ARG),
+      "write hashes to a journal file as they're calculated, so the run can be resumed")(
+      "resume", po::bool_switch(&RESUME_ARG),
+      "reuse the hashes in the checkpoint journal of an interrupted run")("stream",
+      po::bool_switch(&STREAM_ARG),
+      "start the interactive session while hashing, adding groups as they are confirmed")(
       "folder,f", po::value<std::vector<fs::path>>(&PATH_VEC_ARG), "add search folder");
 
     po::positional_options_description p;
@@ -977,14 +3169,44 @@ void parseCommandLine(int argc, char **argv)
     notify(vm);
     // Display help and exit if required options (yes, I know) are missing.
     if (vm.count("help") ||
-      (PATH_VEC_ARG.empty() && RECURSIVE_PATH_VEC_ARG.empty() && MD5_PATH_VEC_ARG.empty())) {
-      fmt::print("{}\nArguments are equivalent to rfolder options\n", desc);
+      (PATH_VEC_ARG.empty() && RECURSIVE_PATH_VEC_ARG.empty() && MD5_PATH_VEC_ARG.empty() &&
+        MANIFEST_PATH_VEC_ARG.empty())) {
+      std::cout << desc << "\nArguments are equivalent to rfolder options\n";
       exit(1);
     }
-    // Switch to md5 hashes if md5lists are used.
-    if (!MD5_PATH_VEC_ARG.empty()) {
+    HASH_ALGO = USE_MD5_ARG ? HashAlgo::MD5 : parseHashAlgo(HASH_ALGO_ARG);
+    // Switch to md5 hashes if md5lists are used or written.
+    auto isMd5ListUsed = !MD5_PATH_VEC_ARG.empty() || !EXPORT_MD5_LIST_ARG.empty();
+    if (isMd5ListUsed && HASH_ALGO != HashAlgo::MD5) {
       fmt::print("Enabled md5 hashes due to md5list being used\n");
-      USE_MD5_ARG = true;
+      HASH_ALGO = HashAlgo::MD5;
+    }
+    // Tree hashes can't be compared with the plain hashes in md5lists.
+    if (isMd5ListUsed && TREE_SEGMENT_SIZE_ARG) {
+      fmt::print("Disabled tree hashes due to md5list being used\n");
+      TREE_SEGMENT_SIZE_ARG = 0;
+    }
+    if (RESUME_ARG && CHECKPOINT_PATH_ARG.empty()) {
+      throw std::invalid_argument("--resume requires --checkpoint");
+    }
+    if (STREAM_ARG && AUTOMATIC_ARG) {
+      throw std::invalid_argument("--stream can't be used with --automatic");
+    }
+    FileReader::setPolicy(parseIoPolicy(IO_POLICY_ARG), static_cast<u64>(READAHEAD_ARG) * 1024);
+    if (DISK_ORDER_ARG != "auto" && DISK_ORDER_ARG != "always" && DISK_ORDER_ARG != "never") {
+      throw std::invalid_argument(fmt::format("Unknown disk order: {}", DISK_ORDER_ARG));
+    }
+    for (auto &deviceThreads : DEVICE_THREADS_VEC_ARG) {
+      auto sepPos = deviceThreads.rfind('=');
+      size_t threadCount = 0;
+      if (sepPos != std::string::npos) {
+        threadCount = std::strtoul(deviceThreads.c_str() + sepPos + 1, nullptr, 10);
+      }
+      if (!threadCount) {
+        throw std::invalid_argument(fmt::format("Invalid device threads: {}", deviceThreads));
+      }
+      auto dev = statPath(fs::path(deviceThreads.substr(0, sepPos))).dev;
+      DEVICE_THREAD_COUNT_MAP[dev] = threadCount;
     }
   }
   catch (std::exception &e) {
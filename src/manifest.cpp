@@ -0,0 +1,277 @@
+// Manifests of hashed files
+
+#include "pch.h"
+#include "manifest.h"
+
+#include <cstdio>
+
+#ifndef WIN32
+#include <unistd.h>
+#endif
+
+namespace fs = boost::filesystem;
+namespace bip = boost::interprocess;
+
+namespace
+{
+const char MANIFEST_MAGIC[8] = {'D', 'P', 'X', 'M', 'A', 'N', 'F', '1'};
+// Size of the buffer between the writers and the file.
+const size_t WRITE_BUF_SIZE(1024 * 1024);
+// Number of 64 bit columns: size, dev, ino, mtime, path end and hash index.
+const size_t U64_COLUMN_COUNT(6);
+
+struct ManifestHeader {
+  char magic[8];
+  char algoName[16];
+  u64 treeSegmentSize;
+  u64 rowCount;
+  u64 hashSize;
+  u64 pathDataSize;
+};
+
+u64 alignUp(u64 v)
+{
+  return (v + 7) & ~static_cast<u64>(7);
+}
+
+// A file that is written through a large buffer under a temporary name, and only replaces the
+// target when it's committed, so a failed write leaves the old file in place.
+class OutFile {
+public:
+  explicit OutFile(const fs::path &path)
+    : path(path), tmpPath(path.native() + ".tmp"), buf(new char[WRITE_BUF_SIZE])
+  {
+    file = std::fopen(tmpPath.c_str(), "wb");
+    if (!file) {
+      fail();
+    }
+    std::setvbuf(file, buf.get(), _IOFBF, WRITE_BUF_SIZE);
+  }
+
+  ~OutFile()
+  {
+    if (file) {
+      std::fclose(file);
+      boost::system::error_code ec;
+      fs::remove(tmpPath, ec);
+    }
+  }
+
+  void write(const void *data, size_t len)
+  {
+    if (std::fwrite(data, 1, len, file) != len) {
+      fail();
+    }
+  }
+
+  void seek(u64 pos)
+  {
+    if (std::fseek(file, static_cast<long>(pos), SEEK_SET) != 0) {
+      fail();
+    }
+  }
+
+  void commit()
+  {
+    auto isError = std::fflush(file) != 0;
+#ifndef WIN32
+    isError |= fsync(fileno(file)) != 0;
+#endif
+    isError |= std::fclose(file) != 0;
+    file = nullptr;
+    if (isError) {
+      fs::remove(tmpPath);
+      fail();
+    }
+    fs::rename(tmpPath, path);
+  }
+
+private:
+  void fail()
+  {
+    throw std::runtime_error(fmt::format("Couldn't write manifest: {}", tmpPath.native()));
+  }
+
+  fs::path path;
+  fs::path tmpPath;
+  std::unique_ptr<char[]> buf;
+  std::FILE *file{nullptr};
+};
+} // namespace
+
+// md5deep -z pads the sizes to 10 digits and separates the fields with two spaces.
+size_t writeMd5List(const fs::path &listPath, size_t rowCount, const ManifestRowFn &rowFn)
+{
+  OutFile out(listPath);
+  fmt::memory_buffer line;
+  size_t skippedCount = 0;
+  for (size_t row = 0; row < rowCount; ++row) {
+    auto entry = rowFn(row);
+    if (entry.path.find_first_of("\r\n") != std::string_view::npos) {
+      ++skippedCount;
+      continue;
+    }
+    line.clear();
+    fmt::format_to(
+      std::back_inserter(line), "{:>10}  {}  {}\n", entry.size, entry.hash, entry.path);
+    out.write(line.data(), line.size());
+  }
+  out.commit();
+  return skippedCount;
+}
+
+// The column of each value is written in a separate pass over the rows, so nothing but the hashes
+// is held in memory, and those only to sort the hash index. The header is written again at the
+// end, when the size of the path data is known.
+void writeManifest(const fs::path &manifestPath, const std::string &algoName, u64 treeSegmentSize,
+  size_t rowCount, const ManifestRowFn &rowFn)
+{
+  ManifestHeader header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, MANIFEST_MAGIC, sizeof(MANIFEST_MAGIC));
+  if (algoName.size() >= sizeof(header.algoName)) {
+    throw std::invalid_argument(fmt::format("Hash algorithm name too long: {}", algoName));
+  }
+  memcpy(header.algoName, algoName.data(), algoName.size());
+  header.treeSegmentSize = treeSegmentSize;
+  header.rowCount = rowCount;
+
+  std::vector<Hash> hashVec(rowCount);
+  for (size_t row = 0; row < rowCount; ++row) {
+    hashVec[row] = rowFn(row).hash;
+    if (hashVec[row].size() != hashVec.front().size() || hashVec[row].empty()) {
+      throw std::invalid_argument(
+        fmt::format("Manifest rows need hashes of the same size: {}", rowFn(row).path));
+    }
+  }
+  header.hashSize = rowCount ? hashVec.front().size() : 0;
+
+  OutFile out(manifestPath);
+  out.write(&header, sizeof(header));
+  auto writeColumn = [&](const std::function<u64(const ManifestEntry &)> &valueFn) {
+    for (size_t row = 0; row < rowCount; ++row) {
+      auto value = valueFn(rowFn(row));
+      out.write(&value, sizeof(value));
+    }
+  };
+  writeColumn([](const ManifestEntry &entry) { return entry.size; });
+  writeColumn([](const ManifestEntry &entry) { return entry.dev; });
+  writeColumn([](const ManifestEntry &entry) { return entry.ino; });
+  writeColumn([](const ManifestEntry &entry) { return static_cast<u64>(entry.mtime); });
+  writeColumn(
+    [&](const ManifestEntry &entry) { return header.pathDataSize += entry.path.size(); });
+
+  std::vector<u64> hashIdxVec(rowCount);
+  for (size_t row = 0; row < rowCount; ++row) {
+    hashIdxVec[row] = row;
+  }
+  std::sort(std::begin(hashIdxVec), std::end(hashIdxVec), [&](u64 a, u64 b) {
+    return hashVec[a] == hashVec[b] ? a < b : hashVec[a] < hashVec[b];
+  });
+  out.write(hashIdxVec.data(), hashIdxVec.size() * sizeof(u64));
+  for (auto &hash : hashVec) {
+    out.write(hash.data(), hash.size());
+  }
+  u64 padding = 0;
+  auto hashDataSize = rowCount * header.hashSize;
+  out.write(&padding, alignUp(hashDataSize) - hashDataSize);
+  for (size_t row = 0; row < rowCount; ++row) {
+    auto path = rowFn(row).path;
+    out.write(path.data(), path.size());
+  }
+  out.seek(0);
+  out.write(&header, sizeof(header));
+  out.commit();
+}
+
+// Only the header is checked here, so opening a manifest costs the same for any number of files.
+// The path offsets and the hash index are checked as they're used.
+Manifest::Manifest(const fs::path &manifestPath)
+{
+  auto invalid = [&]() {
+    return std::runtime_error(fmt::format("Invalid manifest: {}", manifestPath.native()));
+  };
+  mapping = bip::file_mapping(manifestPath.c_str(), bip::read_only);
+  region = bip::mapped_region(mapping, bip::read_only);
+  auto regionSize = region.get_size();
+  auto header = static_cast<const ManifestHeader *>(region.get_address());
+  if (regionSize < sizeof(ManifestHeader) ||
+    memcmp(header->magic, MANIFEST_MAGIC, sizeof(MANIFEST_MAGIC)) != 0 ||
+    header->hashSize > Hash::MAX_SIZE ||
+    header->rowCount > regionSize / (U64_COLUMN_COUNT * sizeof(u64))) {
+    throw invalid();
+  }
+  rowCount = header->rowCount;
+  hashSize = header->hashSize;
+  auto hashOffset = sizeof(ManifestHeader) + rowCount * U64_COLUMN_COUNT * sizeof(u64);
+  auto pathOffset = hashOffset + alignUp(rowCount * hashSize);
+  if (regionSize < pathOffset || regionSize - pathOffset != header->pathDataSize) {
+    throw invalid();
+  }
+  algoName.assign(header->algoName, strnlen(header->algoName, sizeof(header->algoName)));
+  treeSegmentSize = header->treeSegmentSize;
+  pathDataSize = header->pathDataSize;
+  auto columns = reinterpret_cast<const u64 *>(header + 1);
+  sizeVec = columns;
+  devVec = columns + rowCount;
+  inoVec = columns + rowCount * 2;
+  mtimeVec = reinterpret_cast<const s64 *>(columns + rowCount * 3);
+  pathEndVec = columns + rowCount * 4;
+  hashIdxVec = columns + rowCount * 5;
+  hashData = static_cast<const u8 *>(region.get_address()) + hashOffset;
+  pathData = static_cast<const char *>(region.get_address()) + pathOffset;
+}
+
+const std::string &Manifest::getAlgoName() const
+{
+  return algoName;
+}
+
+u64 Manifest::getTreeSegmentSize() const
+{
+  return treeSegmentSize;
+}
+
+size_t Manifest::size() const
+{
+  return rowCount;
+}
+
+ManifestEntry Manifest::getEntry(size_t row) const
+{
+  auto pathBegin = row ? pathEndVec[row - 1] : 0;
+  auto pathEnd = pathEndVec[row];
+  if (pathBegin > pathEnd || pathEnd > pathDataSize) {
+    throw std::runtime_error(fmt::format("Invalid path in manifest row: {}", row));
+  }
+  ManifestEntry entry;
+  entry.path = std::string_view(pathData + pathBegin, pathEnd - pathBegin);
+  entry.size = sizeVec[row];
+  entry.dev = devVec[row];
+  entry.ino = inoVec[row];
+  entry.mtime = mtimeVec[row];
+  entry.hash = getHash(row);
+  return entry;
+}
+
+std::vector<size_t> Manifest::findHash(const Hash &hash) const
+{
+  auto getIdxHash = [&](u64 row) {
+    if (row >= rowCount) {
+      throw std::runtime_error(fmt::format("Invalid row in manifest hash index: {}", row));
+    }
+    return getHash(row);
+  };
+  auto beginIter = std::lower_bound(hashIdxVec, hashIdxVec + rowCount, hash,
+    [&](u64 row, const Hash &hash) { return getIdxHash(row) < hash; });
+  std::vector<size_t> rowVec;
+  for (auto iter = beginIter; iter != hashIdxVec + rowCount && getIdxHash(*iter) == hash; ++iter) {
+    rowVec.push_back(*iter);
+  }
+  return rowVec;
+}
+
+Hash Manifest::getHash(size_t row) const
+{
+  return Hash(hashData + row * hashSize, hashSize);
+}
@@ -0,0 +1,80 @@
+#pragma once
+
+#include "pch.h"
+#include "hash.h"
+
+#include <boost/interprocess/file_mapping.hpp>
+#include <boost/interprocess/mapped_region.hpp>
+#include <string_view>
+
+// Manifests hold the file table of a run, with the full hashes, so that later runs can use the
+// hashes instead of reading the files again. There are two formats. The text format is the one
+// written by md5deep -zr, so it can be read back with --md5list and by other tools, but it only has
+// room for the size, hash and path of each file. The binary format also keeps the device, inode and
+// modification time, so files can be checked for changes and hard links are recognized.
+//
+// The binary format is columnar. After the header come the sizes, devices, inodes, modification
+// times and path offsets of all the files as arrays of 64 bit values, then a hash index, which holds
+// the row numbers sorted by hash, then the hashes and finally the paths. Everything is in native
+// byte order, and each array starts at an 8 byte boundary, so the file is memory mapped and used in
+// place. Files are found by hash with a binary search in the index.
+
+// One file in a manifest. The path only refers to the string it was taken from.
+class ManifestEntry {
+public:
+  std::string_view path;
+  u64 size{0};
+  u64 dev{0};
+  u64 ino{0};
+  s64 mtime{0};
+  Hash hash;
+};
+
+// Get the file in a row. Writers call it several times for each row, so it should be cheap.
+typedef std::function<ManifestEntry(size_t row)> ManifestRowFn;
+
+// The writers stream the rows to a temporary file next to the manifest, which replaces the
+// manifest when it's complete. Both throw if the manifest can't be written.
+//
+// Paths with line breaks can't be written to md5deep lists. Returns the number of those that were
+// skipped.
+size_t writeMd5List(
+  const boost::filesystem::path &listPath, size_t rowCount, const ManifestRowFn &rowFn);
+void writeManifest(const boost::filesystem::path &manifestPath, const std::string &algoName,
+  u64 treeSegmentSize, size_t rowCount, const ManifestRowFn &rowFn);
+
+// Memory mapped binary manifest.
+class Manifest {
+public:
+  // Throws if the manifest can't be read or is damaged.
+  explicit Manifest(const boost::filesystem::path &manifestPath);
+
+  // Name of the hash algorithm, as used with --hash, and the tree segment size in bytes, or 0 if
+  // no files were hashed as trees.
+  [[nodiscard]] const std::string &getAlgoName() const;
+  [[nodiscard]] u64 getTreeSegmentSize() const;
+  [[nodiscard]] size_t size() const;
+  [[nodiscard]] ManifestEntry getEntry(size_t row) const;
+  // Rows of the files with the given hash, in row order.
+  [[nodiscard]] std::vector<size_t> findHash(const Hash &hash) const;
+
+private:
+  [[nodiscard]] Hash getHash(size_t row) const;
+
+  boost::interprocess::file_mapping mapping;
+  boost::interprocess::mapped_region region;
+  std::string algoName;
+  u64 treeSegmentSize{0};
+  size_t rowCount{0};
+  size_t hashSize{0};
+  u64 pathDataSize{0};
+  const u64 *sizeVec{nullptr};
+  const u64 *devVec{nullptr};
+  const u64 *inoVec{nullptr};
+  const s64 *mtimeVec{nullptr};
+  // End of the path of each row in the path data. Each path starts where the one before it ends.
+  const u64 *pathEndVec{nullptr};
+  const u64 *hashIdxVec{nullptr};
+  const u8 *hashData{nullptr};
+  const char *pathData{nullptr};
+};
@@ -187,13 +187,13 @@ void md5::update(const void* a_data, u32 a_data_size)
 
 void md5::update(std::istream& a_istream)
 {
-  u8* buffer = new u8[1024 * 1024];
+  const u32 buffer_size(1024 * 1024);
+  std::unique_ptr<u8[]> buffer(new u8[buffer_size]);
   while (a_istream) {
-    a_istream.read(reinterpret_cast<char*>(&buffer[0]), sizeof(buffer));
+    a_istream.read(reinterpret_cast<char*>(buffer.get()), buffer_size);
 
-    update(buffer, static_cast<u32>(a_istream.gcount()));
+    update(buffer.get(), static_cast<u32>(a_istream.gcount()));
   }
-  delete[] buffer;
 }
 
 void md5::update(std::istream& a_istream, u32 a_size)
@@ -0,0 +1,125 @@
+// Reader for md5deep lists
+
+#include "pch.h"
+#include "md5_list.h"
+
+#include <boost/interprocess/file_mapping.hpp>
+#include <boost/interprocess/mapped_region.hpp>
+
+namespace fs = boost::filesystem;
+namespace bip = boost::interprocess;
+
+namespace
+{
+const size_t MD5_SIZE(16);
+// md5deep puts two spaces between the fields, but lists edited by hand may have only one.
+const size_t MAX_FIELD_SEPARATOR_LEN(2);
+
+// Values of hex digits, or -1 for other characters.
+class HexTable {
+public:
+  HexTable()
+  {
+    std::fill(std::begin(values), std::end(values), -1);
+    for (int i = 0; i < 10; ++i) {
+      values['0' + i] = static_cast<s8>(i);
+    }
+    for (int i = 0; i < 6; ++i) {
+      values['a' + i] = values['A' + i] = static_cast<s8>(10 + i);
+    }
+  }
+
+  s8 values[256];
+};
+
+const HexTable HEX_TABLE;
+
+bool isBlank(char c)
+{
+  return c == ' ' || c == '\t';
+}
+
+// Parse one line, without the line break. Returns false if the line is malformed.
+bool parseLine(const char *p, const char *end, u64 &size, Hash &hash, std::string &path)
+{
+  auto digitBegin = p;
+  size = 0;
+  for (; p != end && *p >= '0' && *p <= '9'; ++p) {
+    size = size * 10 + (*p - '0');
+  }
+  // More than 19 digits could overflow.
+  if (p == digitBegin || p - digitBegin > 19 || p == end || !isBlank(*p)) {
+    return false;
+  }
+  while (p != end && isBlank(*p)) {
+    ++p;
+  }
+  if (end - p < static_cast<ptrdiff_t>(MD5_SIZE * 2)) {
+    return false;
+  }
+  u8 digest[MD5_SIZE];
+  for (size_t i = 0; i < MD5_SIZE; ++i) {
+    auto hi = HEX_TABLE.values[static_cast<u8>(p[i * 2])];
+    auto lo = HEX_TABLE.values[static_cast<u8>(p[i * 2 + 1])];
+    if (hi < 0 || lo < 0) {
+      return false;
+    }
+    digest[i] = static_cast<u8>(hi << 4 | lo);
+  }
+  p += MD5_SIZE * 2;
+  auto separatorBegin = p;
+  while (p != end && isBlank(*p) &&
+    p - separatorBegin < static_cast<ptrdiff_t>(MAX_FIELD_SEPARATOR_LEN)) {
+    ++p;
+  }
+  if (p == separatorBegin || p == end) {
+    return false;
+  }
+  hash = Hash(digest, sizeof(digest));
+  path.assign(p, end);
+  return true;
+}
+} // namespace
+
+void readMd5List(
+  const fs::path &listPath, const Md5EntryFn &entryFn, const Md5MalformedFn &malformedFn)
+{
+  if (!fs::file_size(listPath)) {
+    return;
+  }
+  bip::file_mapping mapping(listPath.c_str(), bip::read_only);
+  bip::mapped_region region(mapping, bip::read_only);
+  region.advise(bip::mapped_region::advice_sequential);
+  auto p = static_cast<const char *>(region.get_address());
+  auto end = p + region.get_size();
+  size_t lineNum = 0;
+  u64 size;
+  Hash hash;
+  std::string path;
+  while (p != end) {
+    auto lineEnd = static_cast<const char *>(memchr(p, '\n', end - p));
+    if (!lineEnd) {
+      lineEnd = end;
+    }
+    ++lineNum;
+    auto lineBegin = p;
+    auto contentEnd = lineEnd;
+    if (contentEnd != lineBegin && contentEnd[-1] == '\r') {
+      --contentEnd;
+    }
+    p = lineEnd == end ? end : lineEnd + 1;
+    // md5deep pads the sizes with spaces to line them up.
+    while (lineBegin != contentEnd && isBlank(*lineBegin)) {
+      ++lineBegin;
+    }
+    if (lineBegin == contentEnd) {
+      continue;
+    }
+    if (parseLine(lineBegin, contentEnd, size, hash, path)) {
+      entryFn(size, hash, path);
+    }
+    else {
+      malformedFn(lineNum, std::string(lineBegin, contentEnd));
+    }
+  }
+}
@@ -0,0 +1,21 @@
+#pragma once
+
+#include "pch.h"
+#include "hash.h"
+
+// Lists of file hashes in the format written by md5deep -z: one file per line, with the size, the
+// MD5 hash and the path, separated by spaces. Example:
+//
+//      43912  ccd6dad4b72d1255cf2e7a9dadd64083  /home/user/test.txt
+//
+// The list is memory mapped and parsed in place, so nothing is kept in memory beyond what the
+// callback keeps, and a list with tens of millions of lines is read in seconds.
+
+// Receives each entry. The path is only valid during the call.
+typedef std::function<void(u64 size, const Hash &hash, const std::string &path)> Md5EntryFn;
+// Receives lines that can't be parsed, with their 1 based line number.
+typedef std::function<void(size_t lineNum, const std::string &line)> Md5MalformedFn;
+
+// Throws if the list can't be read.
+void readMd5List(const boost::filesystem::path &listPath, const Md5EntryFn &entryFn,
+  const Md5MalformedFn &malformedFn);
@@ -0,0 +1,295 @@
+// MD5 of several files at once in SIMD lanes
+
+#include "pch.h"
+#include "md5_multi_buffer.h"
+#include "file_reader.h"
+
+#if defined(__GNUC__) && defined(__x86_64__)
+#define MD5_X86_KERNELS
+#endif
+
+namespace fs = boost::filesystem;
+
+namespace
+{
+// Amount of each file read into its lane at a time. Must be a multiple of the block size.
+const size_t LANE_BUF_SIZE(64 * 1024);
+const size_t BLOCK_SIZE(64);
+// Most lanes of the widest kernel.
+const size_t MAX_LANE_COUNT(16);
+
+const u32 K[64] = {0xd76aa478, 0xe8c7b756, 0x242070db, 0xc1bdceee, 0xf57c0faf, 0x4787c62a,
+  0xa8304613, 0xfd469501, 0x698098d8, 0x8b44f7af, 0xffff5bb1, 0x895cd7be, 0x6b901122, 0xfd987193,
+  0xa679438e, 0x49b40821, 0xf61e2562, 0xc040b340, 0x265e5a51, 0xe9b6c7aa, 0xd62f105d, 0x02441453,
+  0xd8a1e681, 0xe7d3fbc8, 0x21e1cde6, 0xc33707d6, 0xf4d50d87, 0x455a14ed, 0xa9e3e905, 0xfcefa3f8,
+  0x676f02d9, 0x8d2a4c8a, 0xfffa3942, 0x8771f681, 0x6d9d6122, 0xfde5380c, 0xa4beea44, 0x4bdecfa9,
+  0xf6bb4b60, 0xbebfbc70, 0x289b7ec6, 0xeaa127fa, 0xd4ef3085, 0x04881d05, 0xd9d4d039, 0xe6db99e5,
+  0x1fa27cf8, 0xc4ac5665, 0xf4292244, 0x432aff97, 0xab9423a7, 0xfc93a039, 0x655b59c3, 0x8f0ccc92,
+  0xffeff47d, 0x85845dd1, 0x6fa87e4f, 0xfe2ce6e0, 0xa3014314, 0x4e0811a1, 0xf7537e82, 0xbd3af235,
+  0x2ad7d2bb, 0xeb86d391};
+
+const int S[64] = {7, 12, 17, 22, 7, 12, 17, 22, 7, 12, 17, 22, 7, 12, 17, 22, 5, 9, 14, 20, 5, 9,
+  14, 20, 5, 9, 14, 20, 5, 9, 14, 20, 4, 11, 16, 23, 4, 11, 16, 23, 4, 11, 16, 23, 4, 11, 16, 23, 6,
+  10, 15, 21, 6, 10, 15, 21, 6, 10, 15, 21, 6, 10, 15, 21};
+
+// Index of the message word used in each step.
+const int W[64] = {0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 1, 6, 11, 0, 5, 10, 15, 4,
+  9, 14, 3, 8, 13, 2, 7, 12, 5, 8, 11, 14, 1, 4, 7, 10, 13, 0, 3, 6, 9, 12, 15, 2, 0, 7, 14, 5, 12,
+  3, 10, 1, 8, 15, 6, 13, 4, 11, 2, 9};
+
+const u32 INIT_STATE[4] = {0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476};
+
+// Run the MD5 rounds on blockCount consecutive blocks in each lane. V is a 32 bit integer, or a GCC
+// vector of them with one element per lane. The state is stored as all the a values, then all the
+// b values, and so on. The message words are transposed so that each vector holds the same word
+// from all the lanes.
+template <typename V, size_t LANES>
+__attribute__((always_inline)) inline void processBlocks(
+  u32 *state, const u8 *const *laneData, size_t blockCount)
+{
+  V a, b, c, d;
+  memcpy(&a, state + 0 * LANES, sizeof(V));
+  memcpy(&b, state + 1 * LANES, sizeof(V));
+  memcpy(&c, state + 2 * LANES, sizeof(V));
+  memcpy(&d, state + 3 * LANES, sizeof(V));
+  for (size_t blockIdx = 0; blockIdx < blockCount; ++blockIdx) {
+    alignas(64) u32 words[16][LANES];
+    for (size_t lane = 0; lane < LANES; ++lane) {
+      auto block = laneData[lane] + blockIdx * BLOCK_SIZE;
+      for (size_t i = 0; i < 16; ++i) {
+        // Message words are little endian.
+        words[i][lane] = static_cast<u32>(block[i * 4]) | static_cast<u32>(block[i * 4 + 1]) << 8 |
+          static_cast<u32>(block[i * 4 + 2]) << 16 | static_cast<u32>(block[i * 4 + 3]) << 24;
+      }
+    }
+    V m[16];
+    memcpy(m, words, sizeof(m));
+    auto aa = a, bb = b, cc = c, dd = d;
+#pragma GCC unroll 64
+    for (int i = 0; i < 64; ++i) {
+      V f;
+      if (i < 16) {
+        f = (b & c) | (~b & d);
+      }
+      else if (i < 32) {
+        f = (b & d) | (c & ~d);
+      }
+      else if (i < 48) {
+        f = b ^ c ^ d;
+      }
+      else {
+        f = c ^ (b | ~d);
+      }
+      V x = a + f + m[W[i]] + K[i];
+      V t = d;
+      d = c;
+      c = b;
+      b = b + ((x << S[i]) | (x >> (32 - S[i])));
+      a = t;
+    }
+    a += aa;
+    b += bb;
+    c += cc;
+    d += dd;
+  }
+  memcpy(state + 0 * LANES, &a, sizeof(V));
+  memcpy(state + 1 * LANES, &b, sizeof(V));
+  memcpy(state + 2 * LANES, &c, sizeof(V));
+  memcpy(state + 3 * LANES, &d, sizeof(V));
+}
+
+void processBlocksScalar(u32 *state, const u8 *const *laneData, size_t blockCount)
+{
+  processBlocks<u32, 1>(state, laneData, blockCount);
+}
+
+#ifdef MD5_X86_KERNELS
+
+typedef u32 V4 __attribute__((vector_size(16)));
+typedef u32 V8 __attribute__((vector_size(32)));
+typedef u32 V16 __attribute__((vector_size(64)));
+
+__attribute__((target("sse2"))) void processBlocksSse2(
+  u32 *state, const u8 *const *laneData, size_t blockCount)
+{
+  processBlocks<V4, 4>(state, laneData, blockCount);
+}
+
+__attribute__((target("avx2"))) void processBlocksAvx2(
+  u32 *state, const u8 *const *laneData, size_t blockCount)
+{
+  processBlocks<V8, 8>(state, laneData, blockCount);
+}
+
+__attribute__((target("avx512f"))) void processBlocksAvx512(
+  u32 *state, const u8 *const *laneData, size_t blockCount)
+{
+  processBlocks<V16, 16>(state, laneData, blockCount);
+}
+
+#endif
+
+typedef void (*ProcessBlocksFn)(u32 *state, const u8 *const *laneData, size_t blockCount);
+
+struct Kernel {
+  const char *name;
+  size_t laneCount;
+  ProcessBlocksFn processBlocks;
+};
+
+Kernel selectKernel()
+{
+#ifdef MD5_X86_KERNELS
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx512f")) {
+    return {"AVX-512", 16, processBlocksAvx512};
+  }
+  if (__builtin_cpu_supports("avx2")) {
+    return {"AVX2", 8, processBlocksAvx2};
+  }
+  if (__builtin_cpu_supports("sse2")) {
+    return {"SSE2", 4, processBlocksSse2};
+  }
+#endif
+  return {"scalar", 1, processBlocksScalar};
+}
+
+const Kernel &getKernel()
+{
+  static const Kernel kernel = selectKernel();
+  return kernel;
+}
+
+// A file being hashed in one of the lanes. The buffer holds the part of the file that has been
+// read but not yet hashed. The MD5 padding and length are appended after the last part, so the
+// lane always holds whole blocks.
+class Lane {
+public:
+  Lane() : buf(LANE_BUF_SIZE + 2 * BLOCK_SIZE)
+  {
+  }
+
+  // Read the next part of the file.
+  void fill()
+  {
+    auto len = static_cast<size_t>(std::min<u64>(LANE_BUF_SIZE, job.size - offset));
+    reader->readBlock(offset, buf.data(), len);
+    offset += len;
+    bufPos = 0;
+    bufLen = len;
+    if (offset == job.size) {
+      // Pad to 56 bytes into the last block, then add the message length in bits.
+      buf[bufLen++] = 0x80;
+      while (bufLen % BLOCK_SIZE != 56) {
+        buf[bufLen++] = 0;
+      }
+      for (size_t i = 0; i < 8; ++i) {
+        buf[bufLen++] = static_cast<u8>((job.size * 8) >> (i * 8));
+      }
+      isLast = true;
+    }
+  }
+
+  [[nodiscard]] size_t getBlockCount() const
+  {
+    return (bufLen - bufPos) / BLOCK_SIZE;
+  }
+
+  Md5MultiBuffer::Job job;
+  std::unique_ptr<FileReader> reader;
+  std::vector<u8> buf;
+  size_t bufPos{0};
+  size_t bufLen{0};
+  u64 offset{0};
+  bool isLast{false};
+  bool isActive{false};
+};
+} // namespace
+
+void Md5MultiBuffer::run(const NextJobFn &nextJobFn, const DoneFn &doneFn, const FailFn &failFn)
+{
+  const auto &kernel = getKernel();
+  auto laneCount = kernel.laneCount;
+  std::vector<Lane> laneVec(laneCount);
+  std::vector<u32> state(4 * laneCount);
+  // Idle lanes hash zeros into a state that is never used.
+  std::vector<u8> idleBuf(LANE_BUF_SIZE + 2 * BLOCK_SIZE, 0);
+  const u8 *laneData[MAX_LANE_COUNT];
+  auto isJobLeft = true;
+  for (;;) {
+    // Start new files in the idle lanes and read more of the files that have run dry.
+    auto activeCount = 0;
+    for (size_t laneIdx = 0; laneIdx < laneCount; ++laneIdx) {
+      auto &lane = laneVec[laneIdx];
+      while (!lane.isActive || lane.bufPos == lane.bufLen) {
+        if (!lane.isActive) {
+          isJobLeft = isJobLeft && nextJobFn(lane.job);
+          if (!isJobLeft) {
+            break;
+          }
+          lane.offset = 0;
+          lane.isLast = false;
+          for (size_t i = 0; i < 4; ++i) {
+            state[i * laneCount + laneIdx] = INIT_STATE[i];
+          }
+        }
+        try {
+          if (!lane.isActive) {
+            lane.reader = std::make_unique<FileReader>(lane.job.path);
+            lane.isActive = true;
+          }
+          lane.fill();
+        }
+        catch (std::exception &e) {
+          lane.isActive = false;
+          lane.reader.reset();
+          failFn(lane.job.id, e);
+        }
+      }
+      activeCount += lane.isActive;
+    }
+    if (!activeCount) {
+      break;
+    }
+    // Hash as many blocks as all the active lanes have.
+    size_t blockCount = std::numeric_limits<size_t>::max();
+    for (size_t laneIdx = 0; laneIdx < laneCount; ++laneIdx) {
+      auto &lane = laneVec[laneIdx];
+      laneData[laneIdx] = lane.isActive ? lane.buf.data() + lane.bufPos : idleBuf.data();
+      if (lane.isActive) {
+        blockCount = std::min(blockCount, lane.getBlockCount());
+      }
+    }
+    kernel.processBlocks(state.data(), laneData, blockCount);
+    // Report the files that are done.
+    for (size_t laneIdx = 0; laneIdx < laneCount; ++laneIdx) {
+      auto &lane = laneVec[laneIdx];
+      if (!lane.isActive) {
+        continue;
+      }
+      lane.bufPos += blockCount * BLOCK_SIZE;
+      if (lane.bufPos == lane.bufLen && lane.isLast) {
+        u8 digest[16];
+        for (size_t i = 0; i < 4; ++i) {
+          auto v = state[i * laneCount + laneIdx];
+          for (size_t j = 0; j < 4; ++j) {
+            digest[i * 4 + j] = static_cast<u8>(v >> (j * 8));
+          }
+        }
+        lane.isActive = false;
+        lane.reader.reset();
+        doneFn(lane.job.id, Hash(digest, sizeof(digest)));
+      }
+    }
+  }
+}
+
+size_t Md5MultiBuffer::getLaneCount()
+{
+  return getKernel().laneCount;
+}
+
+const char *Md5MultiBuffer::getKernelName()
+{
+  return getKernel().name;
+}
@@ -0,0 +1,32 @@
+#pragma once
+
+#include "pch.h"
+#include "hash.h"
+
+// MD5 of many files at once. MD5 can't be parallelized within a single message, since each block
+// depends on the state left by the previous one, but independent messages can be hashed side by
+// side in the lanes of SIMD registers. Each lane holds the state for one file. The kernel runs the
+// MD5 rounds on one block from each lane at a time, and a file that runs out is replaced with the
+// next one without waiting for the other lanes. The kernel is selected at runtime for the CPU. The
+// digests are the same as the ones from boost::md5.
+class Md5MultiBuffer {
+public:
+  // A file to hash. The id is passed back with the result.
+  class Job {
+  public:
+    size_t id{0};
+    boost::filesystem::path path;
+    u64 size{0};
+  };
+
+  // Get the next file to hash. Returns false when there are no more files.
+  typedef std::function<bool(Job &job)> NextJobFn;
+  typedef std::function<void(size_t id, const Hash &hash)> DoneFn;
+  typedef std::function<void(size_t id, const std::exception &e)> FailFn;
+
+  // Hash files until nextJobFn runs dry.
+  static void run(const NextJobFn &nextJobFn, const DoneFn &doneFn, const FailFn &failFn);
+  // Number of files that are hashed side by side on this CPU. 1 if there's no SIMD kernel.
+  static size_t getLaneCount();
+  static const char *getKernelName();
+};
@@ -25,18 +25,38 @@
 
 // Std
 #include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
 #include <fstream>
+#include <functional>
+#include <future>
 #include <iomanip>
 #include <iostream>
 #include <iterator>
 #include <list>
 #include <locale>
 #include <map>
+#include <memory>
+#include <mutex>
+#include <set>
 #include <sstream>
 #include <string>
+#include <thread>
+#include <tuple>
 #include <unordered_map>
 #include <utility>
 #include <vector>
 
 // App
 #include "int_types.h"
+
+// Format boost paths as their native string, like the ostream operator but without the quotes.
+template <> struct fmt::formatter<boost::filesystem::path> : fmt::formatter<std::string> {
+  template <typename FormatContext> auto format(const boost::filesystem::path &p, FormatContext &ctx)
+  {
+    return fmt::formatter<std::string>::format(p.native(), ctx);
+  }
+};
@@ -0,0 +1,253 @@
+// Matching of paths against sets of rules
+
+#include "pch.h"
+#include "rule_matcher.h"
+
+namespace
+{
+bool isQuantifier(char c)
+{
+  return c == '?' || c == '*' || c == '+' || c == '{';
+}
+} // namespace
+
+RuleMatcher::RuleMatcher() : stateVec(1)
+{
+  const auto &ctype = std::use_facet<std::ctype<char>>(std::locale());
+  for (size_t c = 0; c < ALPHABET_SIZE; ++c) {
+    foldVec[c] = static_cast<u8>(ctype.tolower(static_cast<char>(c)));
+  }
+}
+
+boost::regex RuleMatcher::compileRegex(const std::string &regexStr)
+{
+  try {
+    return boost::regex(regexStr, boost::regbase::perl | boost::regbase::icase);
+  }
+  catch (std::exception &) {
+    throw std::runtime_error(fmt::format("Invalid regular expression: {}", regexStr));
+  }
+}
+
+void RuleMatcher::addRegexRule(const std::string &regexStr)
+{
+  regexVec.push_back(compileRegex(regexStr));
+  literalVec.push_back(getRequiredLiteral(regexStr));
+}
+
+void RuleMatcher::addPathRule(const std::string &path)
+{
+  pathRuleMap.emplace(path, regexVec.size());
+  regexVec.emplace_back();
+  literalVec.emplace_back();
+}
+
+// Each state has a transition for every byte, following the fail links ahead of time, so matching
+// takes a single table lookup per byte of the path.
+void RuleMatcher::compile()
+{
+  stateVec.assign(1, State());
+  unfilteredRuleIdxVec.clear();
+  for (size_t ruleIdx = 0; ruleIdx < literalVec.size(); ++ruleIdx) {
+    if (regexVec[ruleIdx].empty()) {
+      continue;
+    }
+    if (literalVec[ruleIdx].empty()) {
+      unfilteredRuleIdxVec.push_back(ruleIdx);
+      continue;
+    }
+    u32 stateIdx = 0;
+    for (auto c : literalVec[ruleIdx]) {
+      auto &nextIdx = stateVec[stateIdx].nextVec[foldVec[static_cast<u8>(c)]];
+      if (!nextIdx) {
+        nextIdx = static_cast<u32>(stateVec.size());
+        stateVec.emplace_back();
+      }
+      stateIdx = stateVec[stateIdx].nextVec[foldVec[static_cast<u8>(c)]];
+    }
+    stateVec[stateIdx].ruleIdxVec.push_back(ruleIdx);
+  }
+  std::vector<u32> failVec(stateVec.size(), 0);
+  std::deque<u32> stateQueue;
+  for (auto nextIdx : stateVec[0].nextVec) {
+    if (nextIdx) {
+      stateQueue.push_back(nextIdx);
+    }
+  }
+  while (!stateQueue.empty()) {
+    auto stateIdx = stateQueue.front();
+    stateQueue.pop_front();
+    for (size_t c = 0; c < ALPHABET_SIZE; ++c) {
+      auto nextIdx = stateVec[stateIdx].nextVec[c];
+      auto failNextIdx = stateVec[failVec[stateIdx]].nextVec[c];
+      if (!nextIdx) {
+        stateVec[stateIdx].nextVec[c] = failNextIdx;
+        continue;
+      }
+      failVec[nextIdx] = failNextIdx;
+      const auto &failRuleIdxVec = stateVec[failNextIdx].ruleIdxVec;
+      auto &ruleIdxVec = stateVec[nextIdx].ruleIdxVec;
+      ruleIdxVec.insert(
+        std::end(ruleIdxVec), std::begin(failRuleIdxVec), std::end(failRuleIdxVec));
+      stateQueue.push_back(nextIdx);
+    }
+  }
+}
+
+size_t RuleMatcher::getRuleCount() const
+{
+  return regexVec.size();
+}
+
+// The candidates are collected in ruleIdxVec and then narrowed down to the actual matches.
+void RuleMatcher::findMatches(const std::string &path, std::vector<size_t> &ruleIdxVec) const
+{
+  ruleIdxVec.clear();
+  auto pathIter = pathRuleMap.find(path);
+  if (pathIter != pathRuleMap.end()) {
+    ruleIdxVec.push_back(pathIter->second);
+  }
+  if (stateVec.size() > 1) {
+    u32 stateIdx = 0;
+    for (auto c : path) {
+      stateIdx = stateVec[stateIdx].nextVec[foldVec[static_cast<u8>(c)]];
+      const auto &stateRuleIdxVec = stateVec[stateIdx].ruleIdxVec;
+      ruleIdxVec.insert(
+        std::end(ruleIdxVec), std::begin(stateRuleIdxVec), std::end(stateRuleIdxVec));
+    }
+  }
+  ruleIdxVec.insert(
+    std::end(ruleIdxVec), std::begin(unfilteredRuleIdxVec), std::end(unfilteredRuleIdxVec));
+  std::sort(std::begin(ruleIdxVec), std::end(ruleIdxVec));
+  ruleIdxVec.erase(
+    std::unique(std::begin(ruleIdxVec), std::end(ruleIdxVec)), std::end(ruleIdxVec));
+  auto isNoMatch = [&](size_t ruleIdx) {
+    return !regexVec[ruleIdx].empty() && !boost::regex_search(path, regexVec[ruleIdx]);
+  };
+  ruleIdxVec.erase(
+    std::remove_if(std::begin(ruleIdxVec), std::end(ruleIdxVec), isNoMatch), std::end(ruleIdxVec));
+}
+
+// Only characters outside of groups count, since a group may be optional or hold alternatives, and
+// a character followed by a quantifier that allows zero repeats doesn't count either. Anything that
+// isn't understood here ends the current run of literal characters, which can only make the
+// literal shorter. A top level alternative or an inline modifier, which could change how the rest
+// of the pattern is read, means that no literal is required.
+std::string RuleMatcher::getRequiredLiteral(const std::string &regexStr)
+{
+  std::string longest;
+  std::string run;
+  auto endRun = [&]() {
+    if (run.size() > longest.size()) {
+      longest = run;
+    }
+    run.clear();
+  };
+  size_t depth = 0;
+  size_t i = 0;
+  while (i < regexStr.size()) {
+    auto c = regexStr[i++];
+    if (c == '\\') {
+      if (i == regexStr.size()) {
+        break;
+      }
+      auto escaped = regexStr[i++];
+      if (escaped == 'Q' || escaped == 'E') {
+        return {};
+      }
+      // Escaped punctuation is a literal. Letters and digits start classes, anchors, backreferences
+      // and character codes, some of which are followed by arguments.
+      if (!std::isalnum(static_cast<unsigned char>(escaped)) &&
+        static_cast<unsigned char>(escaped) < 0x80) {
+        if (!depth) {
+          run += escaped;
+        }
+        continue;
+      }
+      endRun();
+      if (std::isdigit(static_cast<unsigned char>(escaped))) {
+        while (i < regexStr.size() && std::isdigit(static_cast<unsigned char>(regexStr[i]))) {
+          ++i;
+        }
+      }
+      else if (escaped == 'c') {
+        ++i;
+      }
+      else if (escaped && strchr("xopPNgk", escaped)) {
+        if (i < regexStr.size() && regexStr[i] && strchr("{<'", regexStr[i])) {
+          auto closeChar = regexStr[i] == '{' ? '}' : regexStr[i] == '<' ? '>' : '\'';
+          auto closeIdx = regexStr.find(closeChar, i + 1);
+          i = closeIdx == std::string::npos ? regexStr.size() : closeIdx + 1;
+        }
+        else {
+          while (i < regexStr.size() && std::isalnum(static_cast<unsigned char>(regexStr[i]))) {
+            ++i;
+          }
+        }
+      }
+    }
+    else if (c == '[') {
+      endRun();
+      if (i < regexStr.size() && regexStr[i] == '^') {
+        ++i;
+      }
+      if (i < regexStr.size() && regexStr[i] == ']') {
+        ++i;
+      }
+      while (i < regexStr.size() && regexStr[i] != ']') {
+        // Named classes, such as [:alpha:], end with their own bracket.
+        if (regexStr[i] == '[' && i + 1 < regexStr.size() && regexStr[i + 1] &&
+          strchr(":=.", regexStr[i + 1])) {
+          auto closeIdx = regexStr.find(std::string(1, regexStr[i + 1]) + "]", i + 2);
+          i = closeIdx == std::string::npos ? regexStr.size() : closeIdx + 2;
+          continue;
+        }
+        i += regexStr[i] == '\\' ? 2 : 1;
+      }
+      ++i;
+    }
+    else if (c == '(') {
+      endRun();
+      if (i < regexStr.size() && regexStr[i] == '?' && regexStr.compare(i, 2, "?:") != 0) {
+        return {};
+      }
+      ++depth;
+    }
+    else if (c == ')') {
+      endRun();
+      if (depth) {
+        --depth;
+      }
+    }
+    else if (c == '|') {
+      if (!depth) {
+        return {};
+      }
+    }
+    else if (isQuantifier(c)) {
+      // The character before the quantifier may not be there at all.
+      auto isOptional = c == '?' || c == '*' ||
+        (c == '{' && i < regexStr.size() && (regexStr[i] == '0' || regexStr[i] == ','));
+      if (isOptional && !run.empty()) {
+        run.pop_back();
+      }
+      endRun();
+      if (c == '{') {
+        auto closeIdx = regexStr.find('}', i);
+        i = closeIdx == std::string::npos ? regexStr.size() : closeIdx + 1;
+      }
+      // Lazy and possessive quantifiers.
+      if (i < regexStr.size() && (regexStr[i] == '?' || regexStr[i] == '+')) {
+        ++i;
+      }
+    }
+    else if (c == '.' || c == '^' || c == '$') {
+      endRun();
+    }
+    else if (!depth) {
+      run += c;
+    }
+  }
+  endRun();
+  return longest;
+}
@@ -0,0 +1,51 @@
+#pragma once
+
+#include "pch.h"
+
+// Matches paths against a set of rules in a single pass, instead of running every regex on every
+// path.
+//
+// Path rules are kept in a hash map, so they cost one lookup whatever their number. For each regex,
+// a literal string that any match must contain is picked out of the pattern, and the literals of
+// all the regexes are searched for at once with an Aho-Corasick automaton, which reads each path
+// only once. Most paths contain none of the literals, and are ruled out without running any regex.
+// A regex is only run on the paths that contain its literal. Regexes that no literal can be found
+// for, such as ones that are all alternatives or character classes, are run on every path.
+//
+// Matching doesn't change the matcher, so it can be done from several threads at once.
+class RuleMatcher {
+public:
+  RuleMatcher();
+  // Throws if the regex is invalid.
+  static boost::regex compileRegex(const std::string &regexStr);
+  // Rules are numbered in the order they are added.
+  void addRegexRule(const std::string &regexStr);
+  void addPathRule(const std::string &path);
+  // Build the automaton. Must be called after adding the rules and before matching.
+  void compile();
+  [[nodiscard]] size_t getRuleCount() const;
+  // Set ruleIdxVec to the numbers of the rules that match the path, in increasing order.
+  void findMatches(const std::string &path, std::vector<size_t> &ruleIdxVec) const;
+
+private:
+  static const size_t ALPHABET_SIZE = 256;
+
+  class State {
+  public:
+    std::array<u32, ALPHABET_SIZE> nextVec{};
+    // Rules whose literal ends at this state, including through the fail links.
+    std::vector<size_t> ruleIdxVec;
+  };
+
+  static std::string getRequiredLiteral(const std::string &regexStr);
+
+  std::unordered_map<std::string, size_t> pathRuleMap;
+  // Regexes by rule number. Path rules have empty entries.
+  std::vector<boost::regex> regexVec;
+  std::vector<std::string> literalVec;
+  // Rules that have to be run on every path.
+  std::vector<size_t> unfilteredRuleIdxVec;
+  std::vector<State> stateVec;
+  // Case folding of the regexes, which ignore case as the current locale defines it.
+  std::array<u8, ALPHABET_SIZE> foldVec;
+};
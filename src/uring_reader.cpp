@@ -0,0 +1,385 @@
+// Hashing with reads through io_uring
+
+#include "pch.h"
+#include "uring_reader.h"
+#include "file_reader.h"
+
+#ifdef __linux__
+#define URING_READER_LINUX
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#endif
+
+namespace fs = boost::filesystem;
+
+namespace
+{
+// Reads in flight for each thread. Also the number of buffers in the pool.
+const size_t QUEUE_DEPTH(32);
+// Reads in flight for a single file, so that the chunks of one large file don't take up all the
+// buffers while its first chunk is still on the way.
+const size_t MAX_FILE_READ_COUNT(QUEUE_DEPTH / 2);
+// Size of each read. A multiple of the O_DIRECT alignment, so that files opened with the direct
+// policy are read the same way as the others.
+const size_t BUF_SIZE(256 * 1024);
+const size_t BUF_ALIGNMENT(4096);
+
+#ifdef URING_READER_LINUX
+
+// The parts of io_uring that are needed here, on top of the raw system calls. Only the thread that
+// owns the ring touches it, so the only ordering needed is with the kernel.
+class Ring {
+public:
+  Ring() = default;
+  ~Ring();
+  Ring(const Ring &) = delete;
+  Ring &operator=(const Ring &) = delete;
+
+  // Returns false if io_uring is not available, for instance on old kernels or where it has been
+  // disabled.
+  bool open(unsigned entryCount);
+  // Returns false if the kernel refused to register the buffers, for instance because of the
+  // locked memory limit. The buffers can then still be used with plain reads.
+  bool registerBuffers(const std::vector<iovec> &iovecVec);
+  // Get a cleared submission entry. There must be no more entries queued than the ring was opened
+  // with.
+  io_uring_sqe *getSqe();
+  // Submit the queued entries and wait for at least one completion.
+  void submitAndWait();
+  // Pass each completion to fn and remove it from the ring.
+  template <typename Fn> void reap(Fn fn);
+
+private:
+  int fd{-1};
+  void *sqRing{MAP_FAILED};
+  size_t sqRingSize{0};
+  void *cqRing{MAP_FAILED};
+  size_t cqRingSize{0};
+  io_uring_sqe *sqeArray{nullptr};
+  size_t sqeArraySize{0};
+  unsigned *sqHead{nullptr};
+  unsigned *sqTail{nullptr};
+  unsigned *sqMask{nullptr};
+  unsigned *sqIdxArray{nullptr};
+  unsigned *cqHead{nullptr};
+  unsigned *cqTail{nullptr};
+  unsigned *cqMask{nullptr};
+  io_uring_cqe *cqeArray{nullptr};
+  unsigned sqTailValue{0};
+  unsigned queuedCount{0};
+};
+
+Ring::~Ring()
+{
+  if (sqeArray) {
+    munmap(sqeArray, sqeArraySize);
+  }
+  if (cqRing != MAP_FAILED && cqRing != sqRing) {
+    munmap(cqRing, cqRingSize);
+  }
+  if (sqRing != MAP_FAILED) {
+    munmap(sqRing, sqRingSize);
+  }
+  if (fd != -1) {
+    close(fd);
+  }
+}
+
+bool Ring::open(unsigned entryCount)
+{
+  io_uring_params params;
+  memset(&params, 0, sizeof(params));
+  fd = static_cast<int>(syscall(__NR_io_uring_setup, entryCount, &params));
+  if (fd == -1) {
+    return false;
+  }
+  sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+  // Newer kernels map both rings with a single mapping.
+  auto isSingleMap = params.features & IORING_FEAT_SINGLE_MMAP;
+  if (isSingleMap) {
+    sqRingSize = cqRingSize = std::max(sqRingSize, cqRingSize);
+  }
+  sqRing = mmap(nullptr, sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd,
+    IORING_OFF_SQ_RING);
+  if (sqRing == MAP_FAILED) {
+    return false;
+  }
+  cqRing = isSingleMap ? sqRing
+                       : mmap(nullptr, cqRingSize, PROT_READ | PROT_WRITE,
+                           MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+  if (cqRing == MAP_FAILED) {
+    return false;
+  }
+  sqeArraySize = params.sq_entries * sizeof(io_uring_sqe);
+  auto p = mmap(nullptr, sqeArraySize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd,
+    IORING_OFF_SQES);
+  if (p == MAP_FAILED) {
+    return false;
+  }
+  sqeArray = static_cast<io_uring_sqe *>(p);
+  auto sq = static_cast<u8 *>(sqRing);
+  sqHead = reinterpret_cast<unsigned *>(sq + params.sq_off.head);
+  sqTail = reinterpret_cast<unsigned *>(sq + params.sq_off.tail);
+  sqMask = reinterpret_cast<unsigned *>(sq + params.sq_off.ring_mask);
+  sqIdxArray = reinterpret_cast<unsigned *>(sq + params.sq_off.array);
+  auto cq = static_cast<u8 *>(cqRing);
+  cqHead = reinterpret_cast<unsigned *>(cq + params.cq_off.head);
+  cqTail = reinterpret_cast<unsigned *>(cq + params.cq_off.tail);
+  cqMask = reinterpret_cast<unsigned *>(cq + params.cq_off.ring_mask);
+  cqeArray = reinterpret_cast<io_uring_cqe *>(cq + params.cq_off.cqes);
+  sqTailValue = *sqTail;
+  return true;
+}
+
+bool Ring::registerBuffers(const std::vector<iovec> &iovecVec)
+{
+  return syscall(__NR_io_uring_register, fd, IORING_REGISTER_BUFFERS, iovecVec.data(),
+           static_cast<unsigned>(iovecVec.size())) == 0;
+}
+
+io_uring_sqe *Ring::getSqe()
+{
+  auto idx = sqTailValue & *sqMask;
+  auto sqe = &sqeArray[idx];
+  memset(sqe, 0, sizeof(*sqe));
+  sqIdxArray[idx] = idx;
+  // The new tail is published in submitAndWait(), after the caller has filled in the entry.
+  ++sqTailValue;
+  ++queuedCount;
+  return sqe;
+}
+
+void Ring::submitAndWait()
+{
+  __atomic_store_n(sqTail, sqTailValue, __ATOMIC_RELEASE);
+  for (;;) {
+    auto n = syscall(__NR_io_uring_enter, fd, queuedCount, 1, IORING_ENTER_GETEVENTS, nullptr, 0);
+    if (n >= 0) {
+      queuedCount -= static_cast<unsigned>(n);
+      if (!queuedCount) {
+        return;
+      }
+      continue;
+    }
+    if (errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+      throw std::runtime_error(fmt::format("io_uring_enter failed: {}", strerror(errno)));
+    }
+  }
+}
+
+template <typename Fn> void Ring::reap(Fn fn)
+{
+  auto head = *cqHead;
+  auto tail = __atomic_load_n(cqTail, __ATOMIC_ACQUIRE);
+  for (; head != tail; ++head) {
+    fn(cqeArray[head & *cqMask]);
+  }
+  __atomic_store_n(cqHead, head, __ATOMIC_RELEASE);
+}
+
+struct AlignedFree {
+  void operator()(u8 *p) const
+  {
+    free(p);
+  }
+};
+
+class OpenFile {
+public:
+  UringReader::Job job;
+  std::unique_ptr<FileReader> reader;
+  std::unique_ptr<Hasher> hasher;
+  // End of the part of the file that has been submitted for reading.
+  u64 readOffset{0};
+  // End of the part of the file that has been hashed.
+  u64 hashOffset{0};
+  // Buffers with reads of this file, in file order.
+  std::deque<size_t> bufIdxQueue;
+  bool isFinished{false};
+};
+
+class Read {
+public:
+  OpenFile *file{nullptr};
+  u64 offset{0};
+  u32 len{0};
+  s32 result{0};
+  bool isComplete{false};
+};
+
+#endif
+} // namespace
+
+size_t UringReader::getQueueDepth()
+{
+  return QUEUE_DEPTH;
+}
+
+#ifndef URING_READER_LINUX
+
+bool UringReader::run(HashAlgo, const NextJobFn &, const DoneFn &, const FailFn &)
+{
+  return false;
+}
+
+#else
+
+bool UringReader::run(
+  HashAlgo algo, const NextJobFn &nextJobFn, const DoneFn &doneFn, const FailFn &failFn)
+{
+  Ring ring;
+  if (!ring.open(QUEUE_DEPTH)) {
+    return false;
+  }
+  void *p = nullptr;
+  if (posix_memalign(&p, BUF_ALIGNMENT, QUEUE_DEPTH * BUF_SIZE) != 0) {
+    throw std::bad_alloc();
+  }
+  std::unique_ptr<u8, AlignedFree> pool(static_cast<u8 *>(p));
+  std::vector<iovec> iovecVec(QUEUE_DEPTH);
+  std::vector<size_t> freeBufIdxVec;
+  for (size_t bufIdx = 0; bufIdx < QUEUE_DEPTH; ++bufIdx) {
+    iovecVec[bufIdx].iov_base = pool.get() + bufIdx * BUF_SIZE;
+    iovecVec[bufIdx].iov_len = BUF_SIZE;
+    freeBufIdxVec.push_back(QUEUE_DEPTH - 1 - bufIdx);
+  }
+  auto isFixed = ring.registerBuffers(iovecVec);
+  std::vector<Read> readVec(QUEUE_DEPTH);
+  std::vector<std::unique_ptr<OpenFile>> openFileVec;
+  size_t inFlightCount = 0;
+  auto isJobLeft = true;
+
+  // Files are opened here, on the worker thread, since opening a file can block as well. Empty
+  // files are done as soon as they're open.
+  auto openNextFile = [&]() {
+    auto file = std::make_unique<OpenFile>();
+    isJobLeft = nextJobFn(file->job);
+    if (!isJobLeft) {
+      return;
+    }
+    try {
+      file->reader = std::make_unique<FileReader>(file->job.path);
+      struct stat st;
+      if (fstat(file->reader->getFd(), &st) == -1 ||
+        static_cast<u64>(st.st_size) != file->job.size) {
+        throw fs::filesystem_error("File changed while reading", file->job.path,
+          boost::system::errc::make_error_code(boost::system::errc::io_error));
+      }
+      file->hasher = createHasher(algo);
+    }
+    catch (std::exception &e) {
+      failFn(file->job.id, e);
+      return;
+    }
+    if (!file->job.size) {
+      doneFn(file->job.id, file->hasher->digest());
+      return;
+    }
+    openFileVec.push_back(std::move(file));
+  };
+
+  // Pick a file that has more to read, without letting any one file take up all the buffers.
+  auto findFileToRead = [&]() -> OpenFile * {
+    for (auto &file : openFileVec) {
+      if (!file->isFinished && file->readOffset < file->job.size &&
+        file->bufIdxQueue.size() < MAX_FILE_READ_COUNT) {
+        return file.get();
+      }
+    }
+    return nullptr;
+  };
+
+  // Errors are reported right away. The reads that are still in flight for the file are dropped
+  // as they complete.
+  auto consumeRead = [&](OpenFile &file, Read &read, const u8 *buf) {
+    if (file.isFinished) {
+      return;
+    }
+    try {
+      if (read.result < 0) {
+        throw fs::filesystem_error("Couldn't read file", file.job.path,
+          boost::system::error_code(-read.result, boost::system::system_category()));
+      }
+      file.reader->countReadBytes(read.result);
+      if (static_cast<u32>(read.result) < read.len) {
+        throw fs::filesystem_error("File changed while reading", file.job.path,
+          boost::system::errc::make_error_code(boost::system::errc::io_error));
+      }
+      file.hasher->update(buf, read.len);
+      file.reader->dropConsumed(read.offset, read.len);
+      file.hashOffset += read.len;
+      if (file.hashOffset == file.job.size) {
+        file.isFinished = true;
+        doneFn(file.job.id, file.hasher->digest());
+      }
+    }
+    catch (std::exception &e) {
+      file.isFinished = true;
+      failFn(file.job.id, e);
+    }
+  };
+
+  for (;;) {
+    while (!freeBufIdxVec.empty()) {
+      auto file = findFileToRead();
+      if (!file) {
+        if (!isJobLeft || openFileVec.size() >= QUEUE_DEPTH) {
+          break;
+        }
+        openNextFile();
+        continue;
+      }
+      auto bufIdx = freeBufIdxVec.back();
+      freeBufIdxVec.pop_back();
+      auto &read = readVec[bufIdx];
+      read.file = file;
+      read.offset = file->readOffset;
+      read.len = static_cast<u32>(std::min<u64>(BUF_SIZE, file->job.size - file->readOffset));
+      read.isComplete = false;
+      auto sqe = ring.getSqe();
+      sqe->opcode = isFixed ? IORING_OP_READ_FIXED : IORING_OP_READ;
+      sqe->fd = file->reader->getFd();
+      sqe->off = read.offset;
+      sqe->addr = reinterpret_cast<u64>(iovecVec[bufIdx].iov_base);
+      // O_DIRECT reads must cover whole aligned blocks, also at the end of the file.
+      sqe->len = static_cast<u32>((read.len + BUF_ALIGNMENT - 1) / BUF_ALIGNMENT * BUF_ALIGNMENT);
+      sqe->buf_index = static_cast<u16>(bufIdx);
+      sqe->user_data = bufIdx;
+      file->readOffset += read.len;
+      file->bufIdxQueue.push_back(bufIdx);
+      ++inFlightCount;
+    }
+    if (!inFlightCount) {
+      break;
+    }
+    ring.submitAndWait();
+    ring.reap([&](const io_uring_cqe &cqe) {
+      auto &read = readVec[cqe.user_data];
+      read.result = cqe.res;
+      read.isComplete = true;
+      --inFlightCount;
+    });
+    // Hash the chunks that have arrived, up to the first gap in each file.
+    for (auto &file : openFileVec) {
+      while (!file->bufIdxQueue.empty() && readVec[file->bufIdxQueue.front()].isComplete) {
+        auto bufIdx = file->bufIdxQueue.front();
+        consumeRead(*file, readVec[bufIdx], static_cast<const u8 *>(iovecVec[bufIdx].iov_base));
+        file->bufIdxQueue.pop_front();
+        freeBufIdxVec.push_back(bufIdx);
+      }
+    }
+    openFileVec.erase(std::remove_if(std::begin(openFileVec), std::end(openFileVec),
+                        [](const std::unique_ptr<OpenFile> &file) {
+                          return file->isFinished && file->bufIdxQueue.empty();
+                        }),
+      std::end(openFileVec));
+  }
+  return true;
+}
+
+#endif
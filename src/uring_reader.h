@@ -0,0 +1,34 @@
+#pragma once
+
+#include "pch.h"
+#include "hash.h"
+#include "hasher.h"
+
+// Hash files with their contents read through io_uring. Plain reads block the thread until each
+// chunk arrives, so a few worker threads keep only a few reads in flight, which is not enough to
+// keep fast devices busy. Here, each thread keeps a ring of reads in flight across several files
+// at once, into buffers from a fixed pool that is registered with the kernel, and hashes the
+// chunks as they complete while the kernel works on the rest. Chunks of a file may complete out
+// of order, but are hashed in order. Linux only.
+class UringReader {
+public:
+  // A file to hash. The id is passed back with the result.
+  class Job {
+  public:
+    size_t id{0};
+    boost::filesystem::path path;
+    u64 size{0};
+  };
+
+  // Get the next file to hash. Returns false when there are no more files.
+  typedef std::function<bool(Job &job)> NextJobFn;
+  typedef std::function<void(size_t id, const Hash &hash)> DoneFn;
+  typedef std::function<void(size_t id, const std::exception &e)> FailFn;
+
+  // Hash files until nextJobFn runs dry. Returns false without taking any jobs if io_uring is not
+  // available, so the caller can fall back to reading the files itself.
+  static bool run(
+    HashAlgo algo, const NextJobFn &nextJobFn, const DoneFn &doneFn, const FailFn &failFn);
+  // Number of reads that each thread keeps in flight.
+  static size_t getQueueDepth();
+};
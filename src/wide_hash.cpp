@@ -0,0 +1,321 @@
+// 128 bit SIMD friendly hash
+
+#include "pch.h"
+#include "wide_hash.h"
+
+#if defined(__GNUC__) && defined(__x86_64__)
+#define WIDE_HASH_X86_KERNELS
+#include <immintrin.h>
+#endif
+
+namespace
+{
+const u64 PRIME32_1(0x9E3779B1U);
+const u64 PRIME32_2(0x85EBCA77U);
+const u64 PRIME32_3(0xC2B2AE3DU);
+const u64 PRIME64_1(0x9E3779B185EBCA87ULL);
+const u64 PRIME64_2(0xC2B2AE3D27D4EB4FULL);
+const u64 PRIME64_3(0x165667B19E3779F9ULL);
+const u64 PRIME64_4(0x85EBCA77C2B2AE63ULL);
+const u64 PRIME64_5(0x27D4EB2F165667C5ULL);
+
+// Stripe s of a block is mixed with stripe keys s to s + 7.
+const size_t STRIPE_KEY_COUNT(Wide128::STRIPES_PER_BLOCK + 7);
+
+struct Keys {
+  u64 stripe[STRIPE_KEY_COUNT];
+  u64 scramble[8];
+  u64 final[16];
+};
+
+constexpr u64 splitMix64(u64 &state)
+{
+  u64 z = (state += 0x9E3779B97F4A7C15ULL);
+  z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+  z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+  return z ^ (z >> 31);
+}
+
+// The keys are fixed, so hashes can be stored and compared between runs. They are generated from a
+// fixed seed instead of being spelled out.
+constexpr Keys makeKeys()
+{
+  Keys keys{};
+  u64 state = PRIME64_3;
+  for (auto &key : keys.stripe) {
+    key = splitMix64(state);
+  }
+  for (auto &key : keys.scramble) {
+    key = splitMix64(state);
+  }
+  for (auto &key : keys.final) {
+    key = splitMix64(state);
+  }
+  return keys;
+}
+
+alignas(64) constexpr Keys KEYS = makeKeys();
+
+inline u64 read64(const u8 *p)
+{
+  u64 v;
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+inline void accumulateStripe(u64 *acc, const u8 *data, const u64 *key)
+{
+  for (size_t i = 0; i < 8; ++i) {
+    auto d = read64(data + i * 8);
+    auto k = d ^ key[i];
+    acc[i ^ 1] += d;
+    acc[i] += (k & 0xffffffff) * (k >> 32);
+  }
+}
+
+inline void scramble(u64 *acc)
+{
+  for (size_t i = 0; i < 8; ++i) {
+    auto a = acc[i];
+    a ^= a >> 47;
+    a ^= KEYS.scramble[i];
+    acc[i] = a * PRIME32_1;
+  }
+}
+
+// Process whole blocks. The kernels below do the same thing with SIMD registers.
+void processBlocksScalar(u64 *acc, const u8 *data, size_t blockCount)
+{
+  for (size_t b = 0; b < blockCount; ++b, data += Wide128::BLOCK_SIZE) {
+    for (size_t s = 0; s < Wide128::STRIPES_PER_BLOCK; ++s) {
+      accumulateStripe(acc, data + s * Wide128::STRIPE_SIZE, KEYS.stripe + s);
+    }
+    scramble(acc);
+  }
+}
+
+#ifdef WIDE_HASH_X86_KERNELS
+
+// The 64 bit multiply in the scramble is split into 32x32->64 multiplies, since SSE2 and AVX2 have
+// no 64 bit multiply: a * p = lo(a) * p + (hi(a) * p << 32) for a 32 bit p.
+
+__attribute__((target("sse2"))) void processBlocksSse2(u64 *acc, const u8 *data, size_t blockCount)
+{
+  __m128i a[4];
+  for (size_t i = 0; i < 4; ++i) {
+    a[i] = _mm_loadu_si128(reinterpret_cast<const __m128i *>(acc) + i);
+  }
+  const auto prime = _mm_set1_epi32(static_cast<int>(PRIME32_1));
+  for (size_t b = 0; b < blockCount; ++b, data += Wide128::BLOCK_SIZE) {
+    for (size_t s = 0; s < Wide128::STRIPES_PER_BLOCK; ++s) {
+      auto stripe = reinterpret_cast<const __m128i *>(data + s * Wide128::STRIPE_SIZE);
+      auto key = reinterpret_cast<const __m128i *>(KEYS.stripe + s);
+      for (size_t i = 0; i < 4; ++i) {
+        auto d = _mm_loadu_si128(stripe + i);
+        auto k = _mm_xor_si128(d, _mm_loadu_si128(key + i));
+        auto product = _mm_mul_epu32(k, _mm_shuffle_epi32(k, _MM_SHUFFLE(0, 3, 0, 1)));
+        auto swapped = _mm_shuffle_epi32(d, _MM_SHUFFLE(1, 0, 3, 2));
+        a[i] = _mm_add_epi64(a[i], _mm_add_epi64(product, swapped));
+      }
+    }
+    auto scrambleKey = reinterpret_cast<const __m128i *>(KEYS.scramble);
+    for (size_t i = 0; i < 4; ++i) {
+      auto x = _mm_xor_si128(a[i], _mm_srli_epi64(a[i], 47));
+      x = _mm_xor_si128(x, _mm_loadu_si128(scrambleKey + i));
+      auto lo = _mm_mul_epu32(x, prime);
+      auto hi = _mm_mul_epu32(_mm_srli_epi64(x, 32), prime);
+      a[i] = _mm_add_epi64(lo, _mm_slli_epi64(hi, 32));
+    }
+  }
+  for (size_t i = 0; i < 4; ++i) {
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(acc) + i, a[i]);
+  }
+}
+
+__attribute__((target("avx2"))) void processBlocksAvx2(u64 *acc, const u8 *data, size_t blockCount)
+{
+  __m256i a[2];
+  for (size_t i = 0; i < 2; ++i) {
+    a[i] = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(acc) + i);
+  }
+  const auto prime = _mm256_set1_epi32(static_cast<int>(PRIME32_1));
+  for (size_t b = 0; b < blockCount; ++b, data += Wide128::BLOCK_SIZE) {
+    for (size_t s = 0; s < Wide128::STRIPES_PER_BLOCK; ++s) {
+      auto stripe = reinterpret_cast<const __m256i *>(data + s * Wide128::STRIPE_SIZE);
+      auto key = reinterpret_cast<const __m256i *>(KEYS.stripe + s);
+      for (size_t i = 0; i < 2; ++i) {
+        auto d = _mm256_loadu_si256(stripe + i);
+        auto k = _mm256_xor_si256(d, _mm256_loadu_si256(key + i));
+        auto product = _mm256_mul_epu32(k, _mm256_shuffle_epi32(k, _MM_SHUFFLE(0, 3, 0, 1)));
+        auto swapped = _mm256_shuffle_epi32(d, _MM_SHUFFLE(1, 0, 3, 2));
+        a[i] = _mm256_add_epi64(a[i], _mm256_add_epi64(product, swapped));
+      }
+    }
+    auto scrambleKey = reinterpret_cast<const __m256i *>(KEYS.scramble);
+    for (size_t i = 0; i < 2; ++i) {
+      auto x = _mm256_xor_si256(a[i], _mm256_srli_epi64(a[i], 47));
+      x = _mm256_xor_si256(x, _mm256_loadu_si256(scrambleKey + i));
+      auto lo = _mm256_mul_epu32(x, prime);
+      auto hi = _mm256_mul_epu32(_mm256_srli_epi64(x, 32), prime);
+      a[i] = _mm256_add_epi64(lo, _mm256_slli_epi64(hi, 32));
+    }
+  }
+  for (size_t i = 0; i < 2; ++i) {
+    _mm256_storeu_si256(reinterpret_cast<__m256i *>(acc) + i, a[i]);
+  }
+}
+
+// The unmasked AVX-512 intrinsics pass an undefined vector through, which GCC 12 reports as
+// maybe uninitialized. The zero-masked forms with every lane selected compile to the same
+// instructions without it.
+constexpr __mmask8 ALL_QWORDS = 0xFF;
+constexpr __mmask16 ALL_DWORDS = 0xFFFF;
+
+__attribute__((target("avx512f"))) void processBlocksAvx512(
+  u64 *acc, const u8 *data, size_t blockCount)
+{
+  auto a = _mm512_loadu_si512(acc);
+  const auto prime = _mm512_set1_epi32(static_cast<int>(PRIME32_1));
+  const auto scrambleKey = _mm512_loadu_si512(KEYS.scramble);
+  for (size_t b = 0; b < blockCount; ++b, data += Wide128::BLOCK_SIZE) {
+    for (size_t s = 0; s < Wide128::STRIPES_PER_BLOCK; ++s) {
+      auto d = _mm512_loadu_si512(data + s * Wide128::STRIPE_SIZE);
+      auto k = _mm512_xor_si512(d, _mm512_loadu_si512(KEYS.stripe + s));
+      auto kHi = _mm512_maskz_shuffle_epi32(
+        ALL_DWORDS, k, static_cast<_MM_PERM_ENUM>(_MM_SHUFFLE(0, 3, 0, 1)));
+      auto product = _mm512_maskz_mul_epu32(ALL_QWORDS, k, kHi);
+      auto swapped = _mm512_maskz_shuffle_epi32(
+        ALL_DWORDS, d, static_cast<_MM_PERM_ENUM>(_MM_SHUFFLE(1, 0, 3, 2)));
+      a = _mm512_add_epi64(a, _mm512_add_epi64(product, swapped));
+    }
+    auto x = _mm512_xor_si512(a, _mm512_maskz_srli_epi64(ALL_QWORDS, a, 47));
+    x = _mm512_xor_si512(x, scrambleKey);
+    auto lo = _mm512_maskz_mul_epu32(ALL_QWORDS, x, prime);
+    auto hi = _mm512_maskz_mul_epu32(ALL_QWORDS, _mm512_maskz_srli_epi64(ALL_QWORDS, x, 32), prime);
+    a = _mm512_add_epi64(lo, _mm512_maskz_slli_epi64(ALL_QWORDS, hi, 32));
+  }
+  _mm512_storeu_si512(acc, a);
+}
+
+#endif
+
+typedef void (*ProcessBlocksFn)(u64 *acc, const u8 *data, size_t blockCount);
+
+struct Kernel {
+  const char *name;
+  ProcessBlocksFn processBlocks;
+};
+
+Kernel selectKernel()
+{
+#ifdef WIDE_HASH_X86_KERNELS
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx512f")) {
+    return {"AVX-512", processBlocksAvx512};
+  }
+  if (__builtin_cpu_supports("avx2")) {
+    return {"AVX2", processBlocksAvx2};
+  }
+  if (__builtin_cpu_supports("sse2")) {
+    return {"SSE2", processBlocksSse2};
+  }
+#endif
+  return {"scalar", processBlocksScalar};
+}
+
+const Kernel &getKernel()
+{
+  static const Kernel kernel = selectKernel();
+  return kernel;
+}
+
+// Fold the 128 bit product of a and b to 64 bits.
+inline u64 mulFold64(u64 a, u64 b)
+{
+#ifdef _MSC_VER
+  u64 hi;
+  u64 lo = _umul128(a, b, &hi);
+  return lo ^ hi;
+#else
+  auto product = static_cast<unsigned __int128>(a) * b;
+  return static_cast<u64>(product) ^ static_cast<u64>(product >> 64);
+#endif
+}
+
+inline u64 avalanche(u64 h)
+{
+  h ^= h >> 37;
+  h *= 0x165667919E3779F9ULL;
+  return h ^ (h >> 32);
+}
+} // namespace
+
+Wide128::Wide128()
+  : acc{PRIME32_3, PRIME64_1, PRIME64_2, PRIME64_3, PRIME64_4, PRIME32_2, PRIME64_5, PRIME32_1},
+    bufLen(0), totalLen(0)
+{
+}
+
+// Whole blocks are passed to the kernel straight from the input. Only the parts of blocks that are
+// split between calls are copied to the buffer.
+void Wide128::update(const u8 *data, size_t len)
+{
+  totalLen += len;
+  if (bufLen) {
+    auto n = std::min(len, BLOCK_SIZE - bufLen);
+    memcpy(buf + bufLen, data, n);
+    bufLen += n;
+    data += n;
+    len -= n;
+    if (bufLen < BLOCK_SIZE) {
+      return;
+    }
+    getKernel().processBlocks(acc, buf, 1);
+    bufLen = 0;
+  }
+  auto blockCount = len / BLOCK_SIZE;
+  if (blockCount) {
+    getKernel().processBlocks(acc, data, blockCount);
+  }
+  bufLen = len % BLOCK_SIZE;
+  memcpy(buf, data + blockCount * BLOCK_SIZE, bufLen);
+}
+
+void Wide128::digest(u8 *digest)
+{
+  u64 lo;
+  u64 hi;
+  finish(lo, hi);
+  for (size_t i = 0; i < 8; ++i) {
+    digest[i] = static_cast<u8>(hi >> (56 - i * 8));
+    digest[i + 8] = static_cast<u8>(lo >> (56 - i * 8));
+  }
+}
+
+const char *Wide128::getKernelName()
+{
+  return getKernel().name;
+}
+
+// The last partial block is accumulated without scrambling. Its last partial stripe is padded with
+// zeros, which can't be confused with data since the length is mixed into the result.
+void Wide128::finish(u64 &lo, u64 &hi)
+{
+  size_t s = 0;
+  for (; (s + 1) * STRIPE_SIZE <= bufLen; ++s) {
+    accumulateStripe(acc, buf + s * STRIPE_SIZE, KEYS.stripe + s);
+  }
+  if (s * STRIPE_SIZE < bufLen) {
+    u8 stripe[STRIPE_SIZE] = {};
+    memcpy(stripe, buf + s * STRIPE_SIZE, bufLen - s * STRIPE_SIZE);
+    accumulateStripe(acc, stripe, KEYS.stripe + s);
+  }
+  lo = totalLen * PRIME64_1;
+  hi = ~totalLen * PRIME64_2;
+  for (size_t i = 0; i < 4; ++i) {
+    lo += mulFold64(acc[i * 2] ^ KEYS.final[i * 2], acc[i * 2 + 1] ^ KEYS.final[i * 2 + 1]);
+    hi += mulFold64(acc[i] ^ KEYS.final[8 + i], acc[i + 4] ^ KEYS.final[12 + i]);
+  }
+  lo = avalanche(lo);
+  hi = avalanche(hi ^ lo);
+}
@@ -0,0 +1,32 @@
+#pragma once
+
+#include "pch.h"
+
+// 128 bit non-cryptographic hash built for throughput on wide SIMD units, in the style of XXH3.
+// The input is processed in 64 byte stripes by eight 64 bit accumulators. Each 64 bit lane of a
+// stripe is mixed with a key and its two 32 bit halves are multiplied and added to the accumulator
+// for the lane, while the raw lane is added to the neighboring accumulator. After every block of
+// 16 stripes, the accumulators are scrambled. The lanes are independent, so the same computation
+// maps directly onto SSE2, AVX2 and AVX-512 registers. The kernel is selected at runtime for the
+// CPU, and all kernels produce the same result.
+class Wide128 {
+public:
+  static const size_t STRIPE_SIZE = 64;
+  static const size_t STRIPES_PER_BLOCK = 16;
+  static const size_t BLOCK_SIZE = STRIPE_SIZE * STRIPES_PER_BLOCK;
+
+  Wide128();
+  void update(const u8 *data, size_t len);
+  // Finish the hash and write it to digest as 16 bytes, big endian.
+  void digest(u8 *digest);
+  // Name of the kernel that was selected for this CPU.
+  static const char *getKernelName();
+
+private:
+  void finish(u64 &lo, u64 &hi);
+
+  u64 acc[8];
+  u8 buf[BLOCK_SIZE];
+  size_t bufLen;
+  u64 totalLen;
+};
@@ -0,0 +1,106 @@
+#pragma once
+
+#include "pch.h"
+
+// Work-stealing queue for work items that can produce more work items, such as directories in a
+// recursive scan. Each worker has its own deque. A worker pushes and pops at the back of its own
+// deque, which keeps it working depth first in the part of the tree it's already in, and steals
+// from the front of the other deques when its own runs dry. The deques are guarded by plain
+// mutexes, which are cheap next to the directory reads that the items stand for. Workers that find
+// no items sleep until an item is pushed or all the work is done, so a worker stuck on a slow
+// directory doesn't keep the others spinning.
+template <typename T> class WorkStealingQueue {
+public:
+  explicit WorkStealingQueue(size_t workerCount) : pendingCount(0), queuedCount(0)
+  {
+    for (size_t i = 0; i < workerCount; ++i) {
+      dequeVec.emplace_back(new Deque);
+    }
+  }
+
+  // Add an item to the deque of the given worker.
+  void push(size_t workerIdx, T item)
+  {
+    ++pendingCount;
+    {
+      auto &deque = *dequeVec[workerIdx];
+      std::lock_guard<std::mutex> lock(deque.mutex);
+      deque.items.push_back(std::move(item));
+      ++queuedCount;
+    }
+    std::lock_guard<std::mutex> lock(idleMutex);
+    idleCondition.notify_one();
+  }
+
+  // Get the next item for the given worker, stealing from the other workers if required. Blocks
+  // while other workers are still processing items that may produce more work. Returns false when
+  // all the work is done.
+  bool pop(size_t workerIdx, T &item)
+  {
+    for (;;) {
+      if (popBack(workerIdx, item)) {
+        return true;
+      }
+      for (size_t i = 1; i < dequeVec.size(); ++i) {
+        if (popFront((workerIdx + i) % dequeVec.size(), item)) {
+          return true;
+        }
+      }
+      std::unique_lock<std::mutex> lock(idleMutex);
+      idleCondition.wait(lock, [this]() { return !pendingCount || queuedCount; });
+      if (!pendingCount) {
+        return false;
+      }
+    }
+  }
+
+  // Mark an item returned by pop() as processed. Must be called after any items it produced have
+  // been pushed.
+  void done()
+  {
+    if (!--pendingCount) {
+      std::lock_guard<std::mutex> lock(idleMutex);
+      idleCondition.notify_all();
+    }
+  }
+
+private:
+  struct Deque {
+    std::mutex mutex;
+    std::deque<T> items;
+  };
+
+  bool popBack(size_t workerIdx, T &item)
+  {
+    auto &deque = *dequeVec[workerIdx];
+    std::lock_guard<std::mutex> lock(deque.mutex);
+    if (deque.items.empty()) {
+      return false;
+    }
+    item = std::move(deque.items.back());
+    deque.items.pop_back();
+    --queuedCount;
+    return true;
+  }
+
+  bool popFront(size_t workerIdx, T &item)
+  {
+    auto &deque = *dequeVec[workerIdx];
+    std::lock_guard<std::mutex> lock(deque.mutex);
+    if (deque.items.empty()) {
+      return false;
+    }
+    item = std::move(deque.items.front());
+    deque.items.pop_front();
+    --queuedCount;
+    return true;
+  }
+
+  std::vector<std::unique_ptr<Deque>> dequeVec;
+  // Items that have been pushed but not yet marked as done.
+  std::atomic<size_t> pendingCount;
+  // Items that are in the deques.
+  std::atomic<size_t> queuedCount;
+  std::mutex idleMutex;
+  std::condition_variable idleCondition;
+};